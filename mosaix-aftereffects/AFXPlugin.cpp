@@ -1,9 +1,13 @@
 #include <string>
 #include <algorithm>
 #include <memory>
+#include <mutex>
+#include <vector>
 using namespace std;
 
+#include "../mosaix-core/Allocator.h"
 #include "../mosaix-core/Mosaic.h"
+#include "../mosaix-core/ThreadPool.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +32,18 @@ using namespace std;
 
 static AEGP_PluginID plugin_id;
 
+// Frames of a sequence are usually the same size, so recycle their buffers instead of
+// allocating new ones for every frame.  This is never deleted, in case anything still
+// frees memory into it after we're set down.
+static PoolAllocator *frame_pool = nullptr;
+
+// Sequences usually keep the same size and options from frame to frame, so keep engines
+// around to reuse their memory and plan on the next frame.  Frames can be rendered on more
+// than one thread at once, so each render checks out its own engine.  These are freed in
+// GlobalSetdown.
+static mutex engine_pool_lock;
+static vector<unique_ptr<Mosaic::Engine>> engine_pool;
+
 class AFXErrorException: public exception
 {
 public:
@@ -97,6 +113,37 @@ struct CheckOutParam
     PF_ParamDef &def;
 };
 
+// Check out an engine from engine_pool, and return it when this class goes out of scope.
+struct CheckOutEngine
+{
+    CheckOutEngine()
+    {
+        {
+            lock_guard<mutex> lock(engine_pool_lock);
+            if(!engine_pool.empty())
+            {
+                engine = move(engine_pool.back());
+                engine_pool.pop_back();
+            }
+        }
+
+        if(!engine)
+            engine.reset(new Mosaic::Engine());
+    }
+
+    ~CheckOutEngine()
+    {
+        // Don't throw errors from a dtor.  If the pool can't grow, just free the engine.
+        try {
+            lock_guard<mutex> lock(engine_pool_lock);
+            engine_pool.push_back(move(engine));
+        } catch(const bad_alloc &) {
+        }
+    }
+
+    unique_ptr<Mosaic::Engine> engine;
+};
+
 static void About(PF_InData *in_data, PF_OutData *out_data, PF_ParamDef *params[], PF_LayerDef *output)
 {
     AEGP_SuiteHandler suites(in_data->pica_basicP);
@@ -114,6 +161,26 @@ static void GlobalSetup(PF_InData *in_data, PF_OutData *out_data, PF_ParamDef *p
     PF_Err err = suites.UtilitySuite3()->AEGP_RegisterWithAEGP(NULL, "Plugin", &plugin_id);
     if(err)
         throw AFXErrorException(err);
+
+    if(frame_pool == nullptr)
+        frame_pool = new PoolAllocator();
+    frame_pool->SetMaxPooledBytes(size_t(512) * 1024 * 1024);
+    Allocator::SetCurrent(frame_pool);
+}
+
+static void GlobalSetdown()
+{
+    // Free the engines, then stop pooling and release the buffers we're holding.
+    {
+        lock_guard<mutex> lock(engine_pool_lock);
+        engine_pool.clear();
+    }
+
+    Allocator::SetCurrent(nullptr);
+    if(frame_pool != nullptr)
+        frame_pool->SetMaxPooledBytes(0);
+
+    ThreadPool::Shutdown();
 }
 
 static PF_Err ParamsSetup(PF_InData *in_data, PF_OutData *out_data, PF_ParamDef *params[], PF_LayerDef *output)
@@ -223,7 +290,7 @@ shared_ptr<Image> CopyFromAfterEffects(const PF_InData *in_data, PF_LayerDef *la
     shared_ptr<Image> result = make_shared<Image>();
     result->width = layer->width;
     result->height = layer->height;
-    result->rgba.resize(result->width * result->height);
+    ResizeUninitialized(result->rgba, size_t(result->width) * result->height);
 
     PF_PixelFormat pf = GetPixelFormat(in_data, layer);
     switch(pf)
@@ -301,13 +368,46 @@ void CopyToAfterEffects(PF_InData *in_data, PF_LayerDef *layer, shared_ptr<const
     }
 }
 
-void ApplyMask(shared_ptr<Image> image, shared_ptr<const Image> mask, int offset_x, int offset_y)
+// Copy an 8-bit frame to the output and mosaic it there.  PF_Pixel8 is alpha first with
+// straight color, like Argb8, so the frame is summed in integers and never converted to
+// float.  Rows are a whole number of pixels, so the output can be viewed directly.
+void MosaicAfterEffects_8BPP(PF_InData *in_data, PF_LayerDef *input, PF_LayerDef *output, const Mosaic::Options &options)
+{
+    static_assert(sizeof(PF_Pixel8) == sizeof(Argb8), "PF_Pixel8 must match Argb8");
+
+    PF_Pixel8 *in_pixel_data = NULL;
+    PF_Err err = in_data->utils->get_pixel_data8(input, NULL, &in_pixel_data);
+    if(err)
+        throw AFXErrorException(err);
+
+    PF_Pixel8 *out_pixel_data = NULL;
+    err = PF_GET_PIXEL_DATA8(output, NULL, &out_pixel_data);
+    if(err)
+        throw AFXErrorException(err);
+
+    const char *in_pixel_data_p = (const char *) in_pixel_data;
+    char *out_pixel_data_p = (char *) out_pixel_data;
+    for(int y = 0; y < input->height; ++y)
+        memcpy(&out_pixel_data_p[y*output->rowbytes], &in_pixel_data_p[y*input->rowbytes], input->width * sizeof(PF_Pixel8));
+
+    BasicImageView<Argb8> view((Argb8 *) out_pixel_data, input->width, input->height, output->rowbytes / ptrdiff_t(sizeof(Argb8)));
+
+    CheckOutEngine checkout;
+    checkout.engine->ApplyMosaic(view, options);
+}
+
+// Return a copy of image multiplied by mask.
+shared_ptr<Image> ApplyMask(shared_ptr<const Image> image, shared_ptr<const Image> mask, int offset_x, int offset_y)
 {
+    shared_ptr<Image> result = make_shared<Image>();
+    result->width = image->width;
+    result->height = image->height;
+    ResizeUninitialized(result->rgba, image->rgba.size());
     for(int y = 0; y < image->height; ++y)
     {
         for(int x = 0; x < image->width; ++x)
         {
-            Vec4f &color = image->rgba[y*image->width+x];
+            const Vec4f &color = image->rgba[y*image->width+x];
             int mx = min(max(x + offset_x, 0), mask->width-1);
             int my = min(max(y + offset_y, 0), mask->height-1);
 
@@ -315,9 +415,10 @@ void ApplyMask(shared_ptr<Image> image, shared_ptr<const Image> mask, int offset
 
             // We only support monochrome masks, so multiply by red rather than
             // per-channel.
-            color *= mask_color.x;
+            result->rgba[y*image->width+x] = color * mask_color.x;
         }
     }
+    return result;
 }
 
 shared_ptr<Image> CheckOutAndCopyFromAfterEffects(const PF_InData *in_data, int param)
@@ -356,26 +457,29 @@ static void Render(PF_InData *in_data, PF_OutData *out_data, PF_ParamDef *params
     // we only need to adjust this.
     options.block_size = options.block_size * in_data->downsample_x.num / in_data->downsample_x.den;
 
-    // Read the input image.
-    PF_LayerDef *input = &params[0]->u.ld;
-    shared_ptr<Image> image = CopyFromAfterEffects(in_data, input);
-
     // If the block size is 1, nothing will actually happen.  Skip processing and
     // just copy out the input image.
+    PF_LayerDef *input = &params[0]->u.ld;
     if(options.block_size <= 1.00001f)
-        return CopyToAfterEffects(in_data, output, image);
+        return CopyToAfterEffects(in_data, output, CopyFromAfterEffects(in_data, input));
 
     // If we have a mask, read it.
     shared_ptr<Image> mask = CheckOutAndCopyFromAfterEffects(in_data, Param_Mask);
 
+    // Without a mask, 8-bit frames are mosaiced in 8 bits.  Masks are applied and
+    // composited in float, so masked frames are read into an Image.
+    if(!mask && GetPixelFormat(in_data, input) == PF_PixelFormat_ARGB32)
+        return MosaicAfterEffects_8BPP(in_data, input, output, options);
+
+    // Read the input image.
+    shared_ptr<Image> image = CopyFromAfterEffects(in_data, input);
+
+    // If we have a mask, mosaic a masked copy of the image, and keep the unmasked image
+    // to comp the result over at the end.  Masking writes the copy, so the image is
+    // only copied once.
     shared_ptr<Image> original_image;
     if(mask)
     {
-        // Make a copy of the unmasked image, so we can comp the result over it
-        // at the end.
-        original_image = make_shared<Image>();
-        *original_image = *image;
-
         // Apply the mask to the image we'll mosaic.
         //
         // If mask_offset is in the center of the image (the default), center the mask
@@ -394,11 +498,15 @@ static void Render(PF_InData *in_data, PF_OutData *out_data, PF_ParamDef *params
         offset_x -= mask_offset_x;
         offset_y -= mask_offset_y;
 
-        ApplyMask(image, mask, lrintf(offset_x), lrintf(offset_y));
+        original_image = image;
+        image = ApplyMask(original_image, mask, lrintf(offset_x), lrintf(offset_y));
     }
 
-    // Apply the mosaic.
-    Mosaic::ApplyMosaic(*image.get(), options);
+    // Apply the mosaic with an engine from the pool.
+    {
+        CheckOutEngine checkout;
+        checkout.engine->ApplyMosaic(ImageView(*image.get()), options);
+    }
 
     if(original_image)
     {
@@ -417,6 +525,7 @@ extern "C" DllExport PF_Err PluginMain(PF_Cmd cmd, PF_InData *in_data, PF_OutDat
         switch(cmd) {
         case PF_Cmd_ABOUT: About(in_data, out_data, params, output); break;
         case PF_Cmd_GLOBAL_SETUP: GlobalSetup( in_data, out_data, params, output); break;
+        case PF_Cmd_GLOBAL_SETDOWN: GlobalSetdown(); break;
         case PF_Cmd_PARAMS_SETUP: return ParamsSetup( in_data, out_data, params, output); break;
         case PF_Cmd_RENDER: Render( in_data, out_data, params, output); break;
         default: return PF_Err_NONE;
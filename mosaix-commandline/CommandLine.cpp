@@ -1,20 +1,100 @@
 #include <stdexcept>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <sstream>
 #include "getopt.h"
+#include "../mosaix-core/Allocator.h"
 #include "../mosaix-core/Mosaic.h"
+#include "../mosaix-core/ThreadPool.h"
 #include "ImageIO.h"
 using namespace std;
 
 void usage(string name)
 {
-    printf("Usage: %s [-b block-size] [-x x-offset] [-y y-offset] [-a angle] [-n] input.exr output.exr\n", name.c_str());
+    printf("Usage: %s [-b block-size] [-x x-offset] [-y y-offset] [-a angle] [-t threads] [-p] [-n] [-l auto|rows|tiles] [-B runs] [-k channel,...] input.exr output.exr [input2.exr output2.exr ...]\n", name.c_str());
 }
 
+// Apply the mosaic to image with apply(image).  If runs is nonzero, apply it runs times,
+// each time to a copy of the original, and print the fastest time.
+template<typename ImageType, typename Apply>
+void ApplyTimed(ImageType &image, int runs, const string &name, Apply apply)
+{
+    if(runs <= 0)
+    {
+        apply(image);
+        return;
+    }
+
+    ImageType original = image;
+    double best = numeric_limits<double>::infinity();
+    for(int run = 0; run < runs; ++run)
+    {
+        image = original;
+        auto start = chrono::steady_clock::now();
+        apply(image);
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+    }
+
+    printf("%s: %.1f ms (best of %i)\n", name.c_str(), best, runs);
+}
+
+// Engines kept from one file to the next.  Files are rendered on the thread pool, and a
+// thread waiting on one file's render can pick up another file, so an engine can't belong
+// to a thread: each file checks one out for the length of its render.
+struct EnginePool
+{
+    mutex lock;
+    vector<unique_ptr<Mosaic::Engine>> engines;
+};
+
+// Check out an engine from pool, and return it when this class goes out of scope.
+struct CheckOutEngine
+{
+    CheckOutEngine(EnginePool &pool_):
+        pool(pool_)
+    {
+        {
+            lock_guard<mutex> lock(pool.lock);
+            if(!pool.engines.empty())
+            {
+                engine = move(pool.engines.back());
+                pool.engines.pop_back();
+            }
+        }
+
+        if(!engine)
+            engine.reset(new Mosaic::Engine());
+    }
+
+    ~CheckOutEngine()
+    {
+        // Don't throw errors from a dtor.  If the pool can't grow, just free the engine.
+        try {
+            lock_guard<mutex> lock(pool.lock);
+            pool.engines.push_back(move(engine));
+        } catch(const bad_alloc &) {
+        }
+    }
+
+    EnginePool &pool;
+    unique_ptr<Mosaic::Engine> engine;
+};
+
 int main(int argc, char *argv[])
 {
     // Compressing the output file can take a good portion of the overall processing time.
     // Allow disabling it for batch use.
     bool enable_compression = true;
+    int threads = 0;
+    bool pin_threads = false;
+    int benchmark_runs = 0;
+    vector<string> data_channels;
 
     Mosaic::Options options;
     while(1) {
@@ -26,10 +106,15 @@ int main(int argc, char *argv[])
             {"angle",           required_argument, 0,  'a' },
             {"offset-x",        required_argument, 0,  'x' },
             {"offset-y",        required_argument, 0,  'y'},
+            {"threads",         required_argument, 0,  't' },
+            {"pin-threads",     no_argument,       0,  'p' },
+            {"layout",          required_argument, 0,  'l' },
+            {"benchmark",       required_argument, 0,  'B' },
+            {"keep-channels",   required_argument, 0,  'k' },
             {0,                 0,                 0,  0 }
         };
 
-        int c = getopt_long(argc, argv, "b:nha:x:y:", long_options, &option_index);
+        int c = getopt_long(argc, argv, "b:nha:x:y:t:pl:B:k:", long_options, &option_index);
         if(c == -1)
             break;
 
@@ -50,6 +135,51 @@ int main(int argc, char *argv[])
             options.origin_y = atoi(optarg);
             break;
 
+        case 't':
+            threads = atoi(optarg);
+            if(threads < 0)
+            {
+                printf("Invalid thread count\n");
+                exit(1);
+            }
+            break;
+
+        case 'p':
+            pin_threads = true;
+            break;
+
+        case 'l':
+            if(!strcmp(optarg, "auto"))
+                options.bucket_layout = Mosaic::BucketLayout::Auto;
+            else if(!strcmp(optarg, "rows"))
+                options.bucket_layout = Mosaic::BucketLayout::RowMajor;
+            else if(!strcmp(optarg, "tiles"))
+                options.bucket_layout = Mosaic::BucketLayout::Tiled;
+            else
+            {
+                printf("Invalid layout\n");
+                exit(1);
+            }
+            break;
+
+        case 'B':
+            benchmark_runs = atoi(optarg);
+            if(benchmark_runs <= 0)
+            {
+                printf("Invalid benchmark run count\n");
+                exit(1);
+            }
+            break;
+
+        case 'k':
+        {
+            stringstream channels(optarg);
+            string channel;
+            while(getline(channels, channel, ','))
+                data_channels.push_back(channel);
+            break;
+        }
+
         case 'b':
             options.block_size = (float) atof(optarg);
 
@@ -71,28 +201,64 @@ int main(int argc, char *argv[])
         }
     }
 
-    if(optind+2 != argc)
+    int files = argc - optind;
+    if(files < 2 || (files % 2) != 0)
     {
         usage(argv[0]);
         return 1;
     }
 
-    string input_filename = argv[optind+0];
-    string output_filename = argv[optind+1];
-    try {
-        // Read the image.
-        Image image;
-
-        ImageHelpers::ReadImage(image, input_filename);
-
-        // Apply the mosaic.
-        Mosaic::ApplyMosaic(image, options);
-        
-        // Write the result.
-        ImageHelpers::WriteImage(image, output_filename, enable_compression);
-    } catch(exception &e) {
-        fprintf(stderr, "%s\n", e.what());
-        return 1;
-    }
-    return 0;
+    // Everything, including decoding and encoding files, runs on the same thread pool, so
+    // processing several files at once doesn't start more threads than we asked for.
+    ThreadPool::Configure(threads, pin_threads);
+
+    // Files are often the same size, so recycle image buffers from one file to the next.
+    // This is static, so it outlives the engines, which free their memory into it.
+    static PoolAllocator pool;
+    Allocator::SetCurrent(&pool);
+
+    // Files are often the same size, so keep engines' memory for the next file.
+    EnginePool engines;
+
+    atomic<bool> failed(false);
+    ThreadPool::Get().ParallelFor(files / 2, 0, [&](int i) {
+        string input_filename = argv[optind + i*2 + 0];
+        string output_filename = argv[optind + i*2 + 1];
+        try {
+            CheckOutEngine checkout(engines);
+            Mosaic::Engine &engine = *checkout.engine;
+
+            // PNGs only have 8 bits per channel, so if we're reading and writing PNGs, work
+            // on 8-bit pixels.  This takes a quarter of the memory of float pixels.
+            if(!ImageHelpers::IsEXR(input_filename) && !ImageHelpers::IsEXR(output_filename))
+            {
+                Image8 image;
+                ImageHelpers::ReadPNG(image, input_filename);
+                ApplyTimed(image, benchmark_runs, input_filename, [&](Image8 &image) {
+                    engine.ApplyMosaic(image.GetView(), options);
+                });
+                ImageHelpers::WritePNG(image, output_filename, enable_compression);
+                return;
+            }
+
+            // Read the image, with all of its channels.
+            MultiChannelImage image;
+
+            ImageHelpers::ReadImage(image, input_filename, data_channels);
+
+            // Apply the mosaic.  Every color channel is mosaiced in one pass with the same
+            // blocks.  Channels that aren't colors are passed through.
+            ApplyTimed(image, benchmark_runs, input_filename, [&](MultiChannelImage &image) {
+                engine.ApplyMosaicLayers(image.GetColorGroupViews(), options);
+            });
+
+            // Write the result.
+            ImageHelpers::WriteImage(image, output_filename, enable_compression);
+        } catch(exception &e) {
+            fprintf(stderr, "%s: %s\n", input_filename.c_str(), e.what());
+            failed = true;
+        }
+    });
+
+    return failed? 1:0;
 }
@@ -1,4 +1,5 @@
 #include "ImageIO.h"
+#include "../mosaix-core/ThreadPool.h"
 
 #include <algorithm>
 using namespace std;
@@ -21,9 +22,14 @@ static string get_extension(string filename)
     return filename.substr(dot+1);
 }
 
+bool ImageHelpers::IsEXR(string filename)
+{
+    return !stricmp(get_extension(filename).c_str(), "exr");
+}
+
 void ImageHelpers::ReadImage(Image &image, string filename)
 {
-    if(!stricmp(get_extension(filename).c_str(), "exr"))
+    if(IsEXR(filename))
         ImageHelpers::ReadEXR(image, filename);
     else
         ImageHelpers::ReadPNG(image, filename);
@@ -46,7 +52,7 @@ namespace
     }
 }
 
-void ImageHelpers::ReadPNG(Image &image, string filename)
+void ImageHelpers::ReadPNG(Image8 &image, string filename)
 {
     FILE *f = fopen(filename.c_str(), "rb");
     if(f == NULL)
@@ -76,41 +82,39 @@ void ImageHelpers::ReadPNG(Image &image, string filename)
     png_uint_32 width, height;
     int depth, type;
     png_get_IHDR(png, info, &width, &height, &depth, &type, NULL, NULL, NULL);
-    vector<png_byte> data(width*height*4);
+
+    // Rgba8 is laid out like libpng's rows, so read straight into the image.  The file is
+    // read on one thread, so Alloc touches the image in parallel first.
+    image.Alloc(width, height);
 
     // libpng wants a pointer to each row.
     vector<png_byte *> rows(height);
     for(unsigned y = 0; y < height; ++y)
-        rows[y] = &data[y*width*4];
+        rows[y] = (png_byte *) &image.ptr(0, y);
 
     png_read_image(png, rows.data());
 
-    // Convert the image to an Image.
-    image.width = width;
-    image.height = height;
-    image.rgba.resize(image.height*image.width);
-
-    for(int y = 0; y < (int) height; ++y)
-    {
-        for(int x = 0; x < (int) width; ++x)
-        {
-            Vec4f &output = image.ptr(x, y);
+    png_read_end(png, info);
+    png_destroy_read_struct(&png, &info, NULL);
+}
 
-            const png_byte *input = &rows[y][x*4];
-            for(int c = 0; c < 4; ++c)
-                output[c] = input[c] / 255.0f;
+void ImageHelpers::ReadPNG(Image &image, string filename)
+{
+    Image8 data;
+    ReadPNG(data, filename);
 
-            // Premultiply:
-            for(int c = 0; c < 3; ++c)
-                output[c] *= output.w;
-        }
-    }
+    // Convert the image to an Image.
+    image.width = data.width;
+    image.height = data.height;
+    ResizeUninitialized(image.rgba, size_t(image.width) * image.height);
 
-    png_read_end(png, info);
-    png_destroy_read_struct(&png, &info, NULL);
+    ThreadPool::Get().ParallelFor(image.height, 0, [&](int y) {
+        for(int x = 0; x < image.width; ++x)
+            image.ptr(x, y) = PixelTraits<Rgba8>::Load(data.ptr(x, y));
+    });
 }
 
-void ImageHelpers::WritePNG(const Image &image, string filename, bool compression)
+void ImageHelpers::WritePNG(const Image8 &image, string filename, bool compression)
 {
     FILE *f = fopen(filename.c_str(), "wb");
     if(f == NULL)
@@ -129,20 +133,35 @@ void ImageHelpers::WritePNG(const Image &image, string filename, bool compressio
         png_set_compression_level(png, Z_NO_COMPRESSION);
     png_write_info(png, info);
 
-    // Copy out the image to write it.
-    basic_string<uint8_t> buf;
-    buf.resize(image.width*4);
-    for(int y = 0; y < image.height; y++)
-    {
+    vector<png_byte *> rows(image.height);
+    for(int y = 0; y < image.height; ++y)
+        rows[y] = (png_byte *) &image.ptr(0, y);
+
+    png_write_image(png, rows.data());
+
+    png_write_end(png, NULL);
+
+    fclose(f);
+}
+
+void ImageHelpers::WritePNG(const Image &image, string filename, bool compression)
+{
+    // Convert the whole image up front, so the conversion can run in parallel.
+    Image8 data;
+    data.width = image.width;
+    data.height = image.height;
+    ResizeUninitialized(data.pixels, size_t(image.width) * image.height);
+
+    ThreadPool::Get().ParallelFor(image.height, 0, [&](int y) {
         for(int x = 0; x < image.width; ++x)
         {
-            int offset = y*image.width + x;
-            float alpha = image.rgba[offset].w;
-            uint8_t *output = &buf[x*4];
+            const Vec4f &input = image.ptr(x, y);
+            float alpha = input.w;
+            uint8_t *output = &data.ptr(x, y).r;
 
             for(int c = 0; c < 4; ++c)
             {
-                float value = image.rgba[offset][c];
+                float value = input[c];
 
                 // Unpremultiply and convert to 8-bit.
                 if(c != 3 && alpha > 0.000001f)
@@ -153,17 +172,14 @@ void ImageHelpers::WritePNG(const Image &image, string filename, bool compressio
                 output[c] = uint8_t(lrintf(value * 255.0f));
             }
         }
-        png_write_row(png, buf.data());
-    }
-
-    png_write_end(png, NULL);
+    });
 
-    fclose(f);
+    WritePNG(data, filename, compression);
 }
 
 void ImageHelpers::WriteImage(const Image &image, string filename, bool compression)
 {
-    if(!stricmp(get_extension(filename).c_str(), "exr"))
+    if(IsEXR(filename))
         ImageHelpers::WriteEXR(image, filename, compression);
     else
         ImageHelpers::WritePNG(image, filename, compression);
@@ -176,7 +192,10 @@ void ImageHelpers::ReadEXR(Image &image, string filename)
     Box2i dw = header.dataWindow();
     image.width = dw.max.x - dw.min.x + 1;
     image.height = dw.max.y - dw.min.y + 1;
-    image.rgba.resize(image.height*image.width);
+
+    // The file is read on one thread, so touch the image in parallel first.  Otherwise,
+    // all of it would land on that thread's NUMA node.
+    image.Alloc(image.width, image.height);
 
     FrameBuffer input_framebuffer;
     input_framebuffer.insert("R", Slice(FLOAT, (char *) &image.rgba[0].x, sizeof(V4f), sizeof(V4f) * image.width));
@@ -205,3 +224,173 @@ void ImageHelpers::WriteEXR(const Image &image, string filename, bool compressio
     output_file.setFrameBuffer(framebuffer);
     output_file.writePixels(image.height);
 }
+
+void ImageHelpers::ReadImage(MultiChannelImage &image, string filename, const vector<string> &data_channels)
+{
+    if(IsEXR(filename))
+    {
+        ImageHelpers::ReadEXR(image, filename, data_channels);
+        return;
+    }
+
+    image.channels = 4;
+    image.color_groups = 1;
+    image.channel_names.clear();
+    image.channel_types.clear();
+    image.groups.resize(1);
+    ImageHelpers::ReadPNG(image.groups[0], filename);
+    image.width = image.groups[0].width;
+    image.height = image.groups[0].height;
+}
+
+void ImageHelpers::WriteImage(const MultiChannelImage &image, string filename, bool compression)
+{
+    if(IsEXR(filename))
+        ImageHelpers::WriteEXR(image, filename, compression);
+    else
+        ImageHelpers::WritePNG(image.groups[0], filename, compression);
+}
+
+namespace
+{
+    const char *const rgba_names[] = { "R", "G", "B", "A" };
+
+    // Return the name to save a channel as, or "" if it shouldn't be saved.
+    string get_channel_name(const MultiChannelImage &image, int c)
+    {
+        if(c < int(image.channel_names.size()))
+            return image.channel_names[c];
+        if(c < 4)
+            return rgba_names[c];
+        return "channel" + to_string(c);
+    }
+
+    typedef MultiChannelImage::ChannelType ChannelType;
+
+    ChannelType get_channel_type(const MultiChannelImage &image, int c)
+    {
+        return c < int(image.channel_types.size())? image.channel_types[c]:ChannelType::Float;
+    }
+
+    ChannelType from_pixel_type(PixelType type)
+    {
+        switch(type)
+        {
+        case UINT: return ChannelType::UInt;
+        case HALF: return ChannelType::Half;
+        default: return ChannelType::Float;
+        }
+    }
+
+    PixelType to_pixel_type(ChannelType type)
+    {
+        switch(type)
+        {
+        case ChannelType::UInt: return UINT;
+        case ChannelType::Half: return HALF;
+        default: return FLOAT;
+        }
+    }
+
+    // Return true if a channel isn't a color, and should be passed through instead of
+    // mosaiced.
+    bool is_data_channel(const string &name, const Channel &channel, const vector<string> &data_channels)
+    {
+        if(channel.type == UINT)
+            return true;
+        if(find(data_channels.begin(), data_channels.end(), name) != data_channels.end())
+            return true;
+
+        // Depth channels are Z and ZBack, or those names in a layer, like "beauty.Z".
+        size_t dot = name.rfind('.');
+        string base = dot == string::npos? name:name.substr(dot+1);
+        return base == "Z" || base == "ZBack";
+    }
+
+    // Return the slice for reading or writing channel c.  Integer channels that aren't
+    // colors are read and written as their bits.  Everything else is converted to float.
+    Slice get_channel_slice(const MultiChannelImage &image, int c)
+    {
+        const Image &group = image.groups[c / 4];
+        bool bits = c >= image.color_groups*4 && get_channel_type(image, c) == ChannelType::UInt;
+        return Slice(bits? UINT:FLOAT, (char *) &group.rgba[0][c % 4], sizeof(V4f), sizeof(V4f) * image.width);
+    }
+}
+
+void ImageHelpers::ReadEXR(MultiChannelImage &image, string filename, const vector<string> &data_channels)
+{
+    InputFile input_file(filename.c_str());
+    Header header = input_file.header();
+    Box2i dw = header.dataWindow();
+
+    // Put R, G, B and A first, then the other colors, then the channels that aren't colors,
+    // each in the order the file lists them.
+    vector<string> names(4), data_names;
+    vector<ChannelType> types(4, ChannelType::Float), data_types;
+    for(ChannelList::ConstIterator it = header.channels().begin(); it != header.channels().end(); ++it)
+    {
+        string name = it.name();
+        ChannelType type = from_pixel_type(it.channel().type);
+        const char *const *rgba = find(begin(rgba_names), end(rgba_names), name);
+        if(rgba != end(rgba_names))
+        {
+            names[rgba - begin(rgba_names)] = name;
+            types[rgba - begin(rgba_names)] = type;
+        }
+        else if(is_data_channel(name, it.channel(), data_channels))
+        {
+            data_names.push_back(name);
+            data_types.push_back(type);
+        }
+        else
+        {
+            names.push_back(name);
+            types.push_back(type);
+        }
+    }
+
+    // Start the channels that aren't colors on a group of their own.
+    int color_groups = int(names.size() + 3) / 4;
+    names.resize(color_groups * 4);
+    types.resize(color_groups * 4, ChannelType::Float);
+    names.insert(names.end(), data_names.begin(), data_names.end());
+    types.insert(types.end(), data_types.begin(), data_types.end());
+
+    // Alloc touches the image in parallel, since the file is read on one thread.
+    image.Alloc(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1, int(names.size()));
+    image.color_groups = color_groups;
+    image.channel_names = names;
+    image.channel_types = types;
+
+    // Channels the file doesn't have are left zeroed.
+    FrameBuffer input_framebuffer;
+    for(int c = 0; c < image.channels; ++c)
+    {
+        if(!names[c].empty())
+            input_framebuffer.insert(names[c].c_str(), get_channel_slice(image, c));
+    }
+
+    input_file.setFrameBuffer(input_framebuffer);
+    input_file.readPixels(dw.min.y, dw.max.y);
+}
+
+void ImageHelpers::WriteEXR(const MultiChannelImage &image, string filename, bool compression)
+{
+    Header header(image.width, image.height);
+    header.compression() = compression? PIZ_COMPRESSION:NO_COMPRESSION;
+
+    FrameBuffer framebuffer;
+    for(int c = 0; c < image.channels; ++c)
+    {
+        string name = get_channel_name(image, c);
+        if(name.empty())
+            continue;
+
+        header.channels().insert(name.c_str(), Channel(to_pixel_type(get_channel_type(image, c))));
+        framebuffer.insert(name.c_str(), get_channel_slice(image, c));
+    }
+
+    OutputFile output_file(filename.c_str(), header);
+    output_file.setFrameBuffer(framebuffer);
+    output_file.writePixels(image.height);
+}
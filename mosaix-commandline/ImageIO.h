@@ -6,6 +6,9 @@
 // Loading and saving PNG and EXR files.
 namespace ImageHelpers
 {
+    // Return true if filename is read and written as an EXR, otherwise it's a PNG.
+    bool IsEXR(string filename);
+
     void ReadImage(Image &image, string filename);
     void ReadPNG(Image &image, string filename);
     void ReadEXR(Image &image, string filename);
@@ -13,6 +16,22 @@ namespace ImageHelpers
     void WriteImage(const Image &image, string filename, bool compression);
     void WritePNG(const Image &image, string filename, bool compression);
     void WriteEXR(const Image &image, string filename, bool compression);
+
+    // Read and write PNGs as 8-bit pixels, without converting them to float.
+    void ReadPNG(Image8 &image, string filename);
+    void WritePNG(const Image8 &image, string filename, bool compression);
+
+    // Read and write every channel of an image.  R, G, B and A are the first four channels,
+    // followed by the file's other color channels, then the channels that aren't colors.
+    // Those are 32-bit integer channels, depth channels named Z or ZBack, and any channel
+    // named in data_channels.  They're put in groups after the colors, so they're passed
+    // through the mosaic unchanged.  Each channel is written with the type it was read
+    // with.  PNGs only have the first four.
+    void ReadImage(MultiChannelImage &image, string filename, const vector<string> &data_channels = {});
+    void ReadEXR(MultiChannelImage &image, string filename, const vector<string> &data_channels = {});
+
+    void WriteImage(const MultiChannelImage &image, string filename, bool compression);
+    void WriteEXR(const MultiChannelImage &image, string filename, bool compression);
 }
 
 #endif
@@ -0,0 +1,182 @@
+#include "Allocator.h"
+#include <algorithm>
+#include <atomic>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    class SystemAllocator: public Allocator
+    {
+    public:
+        void *Allocate(size_t size) override
+        {
+            size = max(size, size_t(1));
+#if defined(_WIN32)
+            return _aligned_malloc(size, Alignment);
+#else
+            size_t alignment = Alignment;
+#if defined(__linux__)
+            // Transparent huge pages can only back whole, aligned huge pages, so align large
+            // allocations to them.  This only asks for huge pages.  If they're disabled or
+            // none are free, the kernel uses normal pages.
+            const size_t huge_page_size = 2*1024*1024;
+            if(size >= huge_page_size)
+                alignment = huge_page_size;
+#endif
+
+            void *result = nullptr;
+            if(posix_memalign(&result, alignment, size) != 0)
+                return nullptr;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+            if(size >= huge_page_size)
+                madvise(result, size & ~(huge_page_size-1), MADV_HUGEPAGE);
+#endif
+            return result;
+#endif
+        }
+
+        void Free(void *p, size_t) override
+        {
+#if defined(_WIN32)
+            _aligned_free(p);
+#else
+            free(p);
+#endif
+        }
+    };
+
+    atomic<Allocator *> current_allocator(nullptr);
+
+    // Allocations smaller than this aren't pooled.  The system heap handles them well.
+    const size_t min_pooled_size = 64*1024;
+}
+
+Allocator &Allocator::GetSystem()
+{
+    static SystemAllocator system_allocator;
+    return system_allocator;
+}
+
+Allocator &Allocator::GetCurrent()
+{
+    Allocator *allocator = current_allocator;
+    return allocator != nullptr? *allocator:GetSystem();
+}
+
+void Allocator::SetCurrent(Allocator *allocator)
+{
+    current_allocator = allocator;
+}
+
+PoolAllocator::PoolAllocator(Allocator &parent_, size_t max_pooled_bytes_):
+    parent(parent_),
+    max_pooled_bytes(max_pooled_bytes_)
+{
+}
+
+PoolAllocator::~PoolAllocator()
+{
+    Trim();
+}
+
+// Round sizes up to a multiple of between 1/16 and 1/8 of their size, so buffers are at
+// most 12.5% larger than they need to be.
+size_t PoolAllocator::get_pooled_size(size_t size)
+{
+    size_t granularity = 4096;
+    while(granularity * 16 <= size)
+        granularity *= 2;
+    return (size + granularity - 1) & ~(granularity - 1);
+}
+
+void *PoolAllocator::Allocate(size_t size)
+{
+    if(size < min_pooled_size)
+        return parent.Allocate(size);
+
+    size_t pooled_size = get_pooled_size(size);
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = free_buffers.find(pooled_size);
+        if(it != free_buffers.end())
+        {
+            void *result = it->second;
+            free_buffers.erase(it);
+            pooled_bytes -= pooled_size;
+            return result;
+        }
+    }
+
+    return parent.Allocate(pooled_size);
+}
+
+void PoolAllocator::Free(void *p, size_t size)
+{
+    if(p == nullptr)
+        return;
+
+    if(size < min_pooled_size)
+    {
+        parent.Free(p, size);
+        return;
+    }
+
+    size_t pooled_size = get_pooled_size(size);
+    {
+        lock_guard<mutex> guard(lock);
+        if(pooled_bytes + pooled_size <= max_pooled_bytes)
+        {
+            free_buffers.emplace(pooled_size, p);
+            pooled_bytes += pooled_size;
+            return;
+        }
+    }
+
+    parent.Free(p, pooled_size);
+}
+
+void PoolAllocator::Trim()
+{
+    trim_to(0);
+}
+
+void PoolAllocator::SetMaxPooledBytes(size_t max_bytes)
+{
+    {
+        lock_guard<mutex> guard(lock);
+        max_pooled_bytes = max_bytes;
+    }
+    trim_to(max_bytes);
+}
+
+size_t PoolAllocator::GetPooledBytes() const
+{
+    lock_guard<mutex> guard(lock);
+    return pooled_bytes;
+}
+
+void PoolAllocator::trim_to(size_t max_bytes)
+{
+    // Free the largest buffers first.  Don't hold the lock while freeing them.
+    vector<pair<size_t, void *>> buffers;
+    {
+        lock_guard<mutex> guard(lock);
+        while(pooled_bytes > max_bytes)
+        {
+            auto it = prev(free_buffers.end());
+            buffers.push_back(*it);
+            pooled_bytes -= it->first;
+            free_buffers.erase(it);
+        }
+    }
+
+    for(auto &buffer: buffers)
+        parent.Free(buffer.second, buffer.first);
+}
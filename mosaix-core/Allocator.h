@@ -0,0 +1,177 @@
+#ifndef Allocator_h
+#define Allocator_h
+
+#include <stddef.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// Where images and bucket grids get their memory.  By default this is the system heap,
+// but a host can install its own Allocator to route allocations to its memory suites,
+// or a PoolAllocator to recycle frame buffers.
+class Allocator
+{
+public:
+    // Allocations are aligned to a cache line, which is enough for any SIMD load.
+    static const size_t Alignment = 64;
+
+    virtual ~Allocator() { }
+
+    // Return size bytes aligned to Alignment, or null if they can't be allocated.  The
+    // memory isn't initialized.
+    virtual void *Allocate(size_t size) = 0;
+
+    // Free memory returned by Allocate.  size is the size that was allocated.
+    virtual void Free(void *p, size_t size) = 0;
+
+    // Return the allocator new buffers are allocated with.
+    static Allocator &GetCurrent();
+
+    // Set the allocator new buffers are allocated with, or go back to the system allocator
+    // if allocator is null.  Buffers are freed by the allocator they came from, so it must
+    // outlive them.
+    static void SetCurrent(Allocator *allocator);
+
+    // Return the system allocator.  On Linux, large allocations are aligned to huge pages
+    // and marked for transparent huge pages, which cuts the number of page faults and TLB
+    // misses on large images.
+    static Allocator &GetSystem();
+};
+
+// An allocator that keeps freed buffers, and reuses them for later allocations of the
+// same size instead of returning them to the system.  Rendering a sequence of frames of
+// the same size allocates the same buffers every frame, and this saves allocating and
+// faulting in fresh memory for each one.
+//
+// Sizes are rounded up, so buffers of similar sizes can be reused for each other.  Small
+// allocations aren't pooled.  At most max_pooled_bytes of free buffers are kept, and
+// buffers freed past that go back to the parent allocator.
+class PoolAllocator: public Allocator
+{
+public:
+    PoolAllocator(Allocator &parent = Allocator::GetSystem(), size_t max_pooled_bytes = size_t(1) << 30);
+    ~PoolAllocator();
+
+    void *Allocate(size_t size) override;
+    void Free(void *p, size_t size) override;
+
+    // Return all free buffers to the parent allocator.
+    void Trim();
+
+    // Set the most free memory to keep, returning buffers past that to the parent allocator.
+    void SetMaxPooledBytes(size_t max_bytes);
+
+    // Return the number of bytes of free buffers being kept.
+    size_t GetPooledBytes() const;
+
+private:
+    PoolAllocator(const PoolAllocator &) = delete;
+    PoolAllocator &operator=(const PoolAllocator &) = delete;
+
+    static size_t get_pooled_size(size_t size);
+    void trim_to(size_t max_bytes);
+
+    Allocator &parent;
+
+    mutable mutex lock;
+    size_t max_pooled_bytes;
+    size_t pooled_bytes = 0;
+
+    // Free buffers by their rounded size.
+    multimap<size_t, void *> free_buffers;
+};
+
+// A standard allocator using an Allocator, so vectors can be allocated through it.  Each
+// vector remembers the allocator it was created with, and frees its memory with it.
+//
+// Elements are initialized as usual.  Buffers that are about to be overwritten can be
+// grown with ResizeUninitialized instead, to skip initializing them.
+template<typename T>
+class BufferAllocator
+{
+public:
+    typedef T value_type;
+    typedef true_type propagate_on_container_copy_assignment;
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    BufferAllocator(): allocator(&Allocator::GetCurrent()) { }
+    BufferAllocator(Allocator &allocator_): allocator(&allocator_) { }
+
+    template<typename U>
+    BufferAllocator(const BufferAllocator<U> &rhs): allocator(rhs.allocator) { }
+
+    // Copies of a vector use the current allocator, not the one the original came from.
+    BufferAllocator select_on_container_copy_construction() const { return BufferAllocator(); }
+
+    T *allocate(size_t count)
+    {
+        if(count > size_t(-1) / sizeof(T))
+            throw bad_alloc();
+
+        void *result = allocator->Allocate(count * sizeof(T));
+        if(result == nullptr)
+            throw bad_alloc();
+        return static_cast<T *>(result);
+    }
+
+    void deallocate(T *p, size_t count)
+    {
+        allocator->Free(p, count * sizeof(T));
+    }
+
+    template<typename U, typename... Args>
+    void construct(U *p, Args&&... args)
+    {
+        ::new((void *) p) U(forward<Args>(args)...);
+    }
+
+    template<typename U>
+    void construct(U *p)
+    {
+        if(!leave_uninitialized())
+            ::new((void *) p) U();
+    }
+
+    // While this is set, construct(p) leaves elements uninitialized.  This is only set by
+    // ResizeUninitialized, for the thread calling it.
+    static bool &leave_uninitialized()
+    {
+        static thread_local bool value = false;
+        return value;
+    }
+
+    template<typename U>
+    bool operator==(const BufferAllocator<U> &rhs) const { return allocator == rhs.allocator; }
+
+    template<typename U>
+    bool operator!=(const BufferAllocator<U> &rhs) const { return allocator != rhs.allocator; }
+
+    Allocator *allocator;
+};
+
+template<typename T>
+using BufferVector = vector<T, BufferAllocator<T>>;
+
+// Resize buffer to size elements, leaving any new elements uninitialized.  This is for
+// buffers that are completely overwritten right away, such as pixels being read from a
+// file, where initializing them first would be wasted work.
+template<typename T>
+void ResizeUninitialized(BufferVector<T> &buffer, size_t size)
+{
+    static_assert(is_trivially_destructible<T>::value, "Only trivial types can be left uninitialized");
+
+    struct LeaveUninitialized
+    {
+        LeaveUninitialized() { BufferAllocator<T>::leave_uninitialized() = true; }
+        ~LeaveUninitialized() { BufferAllocator<T>::leave_uninitialized() = false; }
+    } leave_uninitialized;
+
+    buffer.resize(size);
+}
+
+#endif
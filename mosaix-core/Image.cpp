@@ -1,9 +1,24 @@
 #include "Image.h"
+#include "ThreadPool.h"
+#include "TileOccupancy.h"
+#include "Vec4fKernels.h"
 #include <algorithm>
+#include <limits>
+#include <limits.h>
 
 void Image::Alloc(int width, int height)
 {
-    rgba.resize(width*height, Vec4f());
+    // Zero the pixels on the thread pool, in the same bands ParallelFor gives later work on
+    // the image.  The thread that first touches a page decides which NUMA node it's on, so
+    // this puts each band of rows on the node of the threads that will work on it.
+    rgba.clear();
+    ResizeUninitialized(rgba, size_t(width)*height);
+    const int rows_per_chunk = 16;
+    ThreadPool::Get().ParallelFor((height + rows_per_chunk - 1) / rows_per_chunk, 0, [&](int chunk) {
+        size_t start = size_t(chunk) * rows_per_chunk * width;
+        size_t end = min(size_t(chunk + 1) * rows_per_chunk, size_t(height)) * width;
+        fill(rgba.begin() + start, rgba.begin() + end, Vec4f());
+    });
 }
 
 Vec4f &Image::ptr(int x, int y)
@@ -18,17 +33,65 @@ void swap(Image &lhs, Image &rhs)
     swap(lhs.rgba, rhs.rgba);
 }
 
-void Image::TopLeftVisiblePixel(int &out_x, int &out_y) const
+namespace
+{
+    // Pixels with alpha above 0.01 are visible.
+    const Vec4f visible_threshold(
+        numeric_limits<float>::infinity(), numeric_limits<float>::infinity(),
+        numeric_limits<float>::infinity(), 0.01f);
+
+    // Find the first and last pixels with alpha above 0.01.  The kernels compare the
+    // magnitude of each channel and treat NaN as above, so each pixel they find is checked,
+    // and pixels with negative or NaN alpha are skipped.
+    int FindFirstVisible(const Vec4f *pixels, int count)
+    {
+        int i = 0;
+        while(true)
+        {
+            i += Vec4fKernels::FindFirstAbove(pixels + i, count - i, visible_threshold);
+            if(i == count || pixels[i].w > visible_threshold.w)
+                return i;
+            ++i;
+        }
+    }
+
+    int FindLastVisible(const Vec4f *pixels, int count)
+    {
+        int end = count;
+        while(true)
+        {
+            int i = Vec4fKernels::FindLastAbove(pixels, end, visible_threshold);
+            if(i == -1 || pixels[i].w > visible_threshold.w)
+                return i;
+            end = i;
+        }
+    }
+
+    int FindFirstContent(const Vec4f *pixels, int count)
+    {
+        return Vec4fKernels::FindFirstAbove(pixels, count, Vec4f(0,0,0,0));
+    }
+
+    int FindLastContent(const Vec4f *pixels, int count)
+    {
+        return Vec4fKernels::FindLastAbove(pixels, count, Vec4f(0,0,0,0));
+    }
+}
+
+void Image::TopLeftVisiblePixel(int &out_x, int &out_y, const TileOccupancy *occupancy) const
 {
     out_x = 0;
     out_y = 0;
+    const vector<pair<int,int>> whole_row = { make_pair(0, width) };
     for(int y = 0; y < height; ++y)
     {
-        for(int x = 0; x < width; ++x)
+        for(const pair<int,int> &span: occupancy? occupancy->GetOccupiedSpans(y):whole_row)
         {
-            if(ptr(x,y)[3] > 0.01f)
+            int count = span.second - span.first;
+            int x = FindFirstVisible(&ptr(span.first, y), count);
+            if(x < count)
             {
-                out_x = x;
+                out_x = span.first + x;
                 out_y = y;
                 return;
             }
@@ -36,17 +99,20 @@ void Image::TopLeftVisiblePixel(int &out_x, int &out_y) const
     }
 }
 
-void Image::BottomRightVisiblePixel(int &out_x, int &out_y) const
+void Image::BottomRightVisiblePixel(int &out_x, int &out_y, const TileOccupancy *occupancy) const
 {
     out_x = 0;
     out_y = 0;
+    const vector<pair<int,int>> whole_row = { make_pair(0, width) };
     for(int y = height-1; y >= 0; --y)
     {
-        for(int x = width-1; x >= 0; --x)
+        const vector<pair<int,int>> &spans = occupancy? occupancy->GetOccupiedSpans(y):whole_row;
+        for(auto span = spans.rbegin(); span != spans.rend(); ++span)
         {
-            if(ptr(x,y)[3] > 0.01f)
+            int x = FindLastVisible(&ptr(span->first, y), span->second - span->first);
+            if(x >= 0)
             {
-                out_x = x;
+                out_x = span->first + x;
                 out_y = y;
                 return;
             }
@@ -56,14 +122,99 @@ void Image::BottomRightVisiblePixel(int &out_x, int &out_y) const
 
 void Image::CenterVisiblePixel(int &out_x, int &out_y) const
 {
-    int top_left_x = 0, top_left_y;
-    TopLeftVisiblePixel(top_left_x, top_left_y);
+    // Use the center of the bounding box of visible pixels.
+    int x1, y1, x2, y2;
+    if(!GetVisibleBounds(x1, y1, x2, y2))
+    {
+        out_x = 0;
+        out_y = 0;
+        return;
+    }
 
-    int bottom_right_x = 0, bottom_right_y;
-    BottomRightVisiblePixel(bottom_right_x, bottom_right_y);
+    out_x = (x1 + x2 - 1) / 2;
+    out_y = (y1 + y2 - 1) / 2;
+}
 
-    out_x = (top_left_x + bottom_right_x) / 2;
-    out_y = (top_left_y + bottom_right_y) / 2;
+bool Image::GetVisibleBounds(int &x1, int &y1, int &x2, int &y2, int threads) const
+{
+    return ::GetVisibleBounds(*this, x1, y1, x2, y2, threads);
+}
+
+bool Image::GetContentBounds(int &x1, int &y1, int &x2, int &y2, int threads) const
+{
+    return ::GetContentBounds(*this, x1, y1, x2, y2, threads);
+}
+
+namespace
+{
+    // Find the bounds of the pixels found by find_first and find_last, which are
+    // FindFirstVisible and FindLastVisible or FindFirstContent and FindLastContent.
+    bool GetBounds(const ConstImageView &image, int (*find_first)(const Vec4f *, int), int (*find_last)(const Vec4f *, int),
+        int threads, int &out_x1, int &out_y1, int &out_x2, int &out_y2)
+    {
+        // Find the bounds of each chunk of rows in parallel.  Within a row, search from the
+        // left for the first pixel and from the right for the last, so only the empty parts
+        // at the edges of the row are read.
+        struct Bounds
+        {
+            int x1 = INT_MAX, y1 = INT_MAX, x2 = INT_MIN, y2 = INT_MIN;
+        };
+
+        const int width = image.width, height = image.height;
+        const int rows_per_chunk = 16;
+        vector<Bounds> chunk_bounds((height + rows_per_chunk - 1) / rows_per_chunk);
+        ThreadPool::Get().ParallelFor(int(chunk_bounds.size()), threads, [&](int chunk) {
+            Bounds &bounds = chunk_bounds[chunk];
+            int y_end = min(height, (chunk+1) * rows_per_chunk);
+            for(int y = chunk * rows_per_chunk; y < y_end; ++y)
+            {
+                const Vec4f *row = image.row(y);
+                int first = find_first(row, width);
+                if(first == width)
+                    continue;
+
+                // Anything between first and the current right edge doesn't change the bounds,
+                // so only search to the right of both.
+                int right_start = max(first, bounds.x2);
+                int last = find_last(row + right_start, width - right_start);
+                bounds.x1 = min(bounds.x1, first);
+                bounds.x2 = max(bounds.x2, last == -1? first+1:right_start + last + 1);
+                bounds.y1 = min(bounds.y1, y);
+                bounds.y2 = y + 1;
+            }
+        });
+
+        Bounds result;
+        for(const Bounds &bounds: chunk_bounds)
+        {
+            result.x1 = min(result.x1, bounds.x1);
+            result.y1 = min(result.y1, bounds.y1);
+            result.x2 = max(result.x2, bounds.x2);
+            result.y2 = max(result.y2, bounds.y2);
+        }
+
+        if(result.x1 >= result.x2)
+        {
+            out_x1 = out_y1 = out_x2 = out_y2 = 0;
+            return false;
+        }
+
+        out_x1 = result.x1;
+        out_y1 = result.y1;
+        out_x2 = result.x2;
+        out_y2 = result.y2;
+        return true;
+    }
+}
+
+bool GetVisibleBounds(const ConstImageView &image, int &x1, int &y1, int &x2, int &y2, int threads)
+{
+    return GetBounds(image, FindFirstVisible, FindLastVisible, threads, x1, y1, x2, y2);
+}
+
+bool GetContentBounds(const ConstImageView &image, int &x1, int &y1, int &x2, int &y2, int threads)
+{
+    return GetBounds(image, FindFirstContent, FindLastContent, threads, x1, y1, x2, y2);
 }
 
 void Image::AlphaComposite(shared_ptr<const Image> image)
@@ -72,11 +223,44 @@ void Image::AlphaComposite(shared_ptr<const Image> image)
     if(width != image->width || height != image->height)
         return;
 
-    for(int i = 0; i < width*height; ++i)
+    Vec4fKernels::AlphaComposite(rgba.data(), image->rgba.data(), width*height);
+}
+
+template<typename Pixel>
+void PixelImage<Pixel>::Alloc(int width_, int height_)
+{
+    width = width_;
+    height = height_;
+    pixels.clear();
+    ResizeUninitialized(pixels, size_t(width)*height);
+    const int rows_per_chunk = 16;
+    ThreadPool::Get().ParallelFor((height + rows_per_chunk - 1) / rows_per_chunk, 0, [&](int chunk) {
+        size_t start = size_t(chunk) * rows_per_chunk * width;
+        size_t end = min(size_t(chunk + 1) * rows_per_chunk, size_t(height)) * width;
+        fill(pixels.begin() + start, pixels.begin() + end, Pixel());
+    });
+}
+
+template class PixelImage<Rgba8>;
+template class PixelImage<Rgba16>;
+template class PixelImage<RgbaHalf>;
+
+void MultiChannelImage::Alloc(int width_, int height_, int channels_)
+{
+    width = width_;
+    height = height_;
+    channels = max(channels_, 4);
+    groups.resize((channels + 3) / 4);
+    color_groups = int(groups.size());
+    for(Image &group: groups)
     {
-        Vec4f &bottom = rgba[i];
-        const Vec4f &top = image->rgba[i];
-        bottom = bottom*(1-top.w) + top;
+        group.width = width;
+        group.height = height;
+        group.Alloc(width, height);
     }
 }
 
+vector<ImageView> MultiChannelImage::GetColorGroupViews()
+{
+    return vector<ImageView>(groups.begin(), groups.begin() + min(color_groups, int(groups.size())));
+}
@@ -1,27 +1,47 @@
 #ifndef Image_h
 #define Image_h
 
+#include <stddef.h>
+#include <string>
 #include <vector>
 #include <memory>
 using namespace std;
 
+#include "Allocator.h"
+#include "PixelFormats.h"
 #include "Vec4f.h"
 
-// A simple container for a 4-channel floating-point image.
+class TileOccupancy;
+
+// A simple container for a 4-channel floating-point image.  Pixels are allocated from
+// the current Allocator.  Alloc zeroes them, and ResizeUninitialized(rgba, n) sizes them
+// without initializing them, for images that are about to be overwritten.
 
 class Image
 {
 public:
     int width = 1, height = 1;
-    vector<Vec4f> rgba;
+    BufferVector<Vec4f> rgba;
 
+    // Allocate and zero the image.  On NUMA systems, its rows are spread across nodes.
     void Alloc(int width, int height);
     Vec4f &ptr(int x, int y);
     const Vec4f &ptr(int x, int y) const { return const_cast<Image *>(this)->ptr(x, y); }
-    void TopLeftVisiblePixel(int &x, int &y) const;
-    void BottomRightVisiblePixel(int &x, int &y) const;
+
+    // Find visible pixels.  If occupancy is given, it must be a scan of this image,
+    // and tiles it marks as empty won't be searched.
+    void TopLeftVisiblePixel(int &x, int &y, const TileOccupancy *occupancy = nullptr) const;
+    void BottomRightVisiblePixel(int &x, int &y, const TileOccupancy *occupancy = nullptr) const;
     void CenterVisiblePixel(int &x, int &y) const;
 
+    // Find the bounding box [x1,x2) x [y1,y2) of the pixels with alpha above 0.01, using
+    // up to threads threads from the shared ThreadPool, or all of them if threads is 0.
+    // Return false if there are no visible pixels.
+    bool GetVisibleBounds(int &x1, int &y1, int &x2, int &y2, int threads = 0) const;
+
+    // The same, for every pixel that isn't empty: any of its channels is nonzero.
+    bool GetContentBounds(int &x1, int &y1, int &x2, int &y2, int threads = 0) const;
+
     // Composite image over this one.  image must be premultiplied and
     // have the same dimensions as this one.
     void AlphaComposite(shared_ptr<const Image> image);
@@ -29,4 +49,116 @@ public:
 
 void swap(Image &lhs, Image &rhs);
 
+// A view of premultiplied pixels in memory we don't own, such as a host's frame buffer, so
+// it can be worked on without copying it into an Image.  Only w is treated as alpha, so
+// the color channels can be in any order.  Rows are stride pixels apart.  stride may be
+// more than width, or negative for images stored bottom-up.  Pixels must be aligned like
+// Vec4f.
+//
+// ImageView can write to the pixels, and ConstImageView can only read them.  Images and
+// ImageViews convert to either.
+template<typename Pixel>
+struct BasicImageView
+{
+    Pixel *pixels = nullptr;
+    int width = 0, height = 0;
+    ptrdiff_t stride = 0;
+
+    BasicImageView() { }
+    BasicImageView(Pixel *pixels_, int width_, int height_, ptrdiff_t stride_):
+        pixels(pixels_), width(width_), height(height_), stride(stride_)
+    {
+    }
+
+    BasicImageView(Image &image):
+        pixels(image.rgba.data()), width(image.width), height(image.height), stride(image.width)
+    {
+    }
+
+    BasicImageView(const Image &image):
+        pixels(image.rgba.data()), width(image.width), height(image.height), stride(image.width)
+    {
+    }
+
+    template<typename OtherPixel>
+    BasicImageView(const BasicImageView<OtherPixel> &view):
+        pixels(view.pixels), width(view.width), height(view.height), stride(view.stride)
+    {
+    }
+
+    Pixel *row(int y) const { return pixels + y*stride; }
+};
+
+typedef BasicImageView<Vec4f> ImageView;
+typedef BasicImageView<const Vec4f> ConstImageView;
+
+// Image::GetVisibleBounds and GetContentBounds for a view.
+bool GetVisibleBounds(const ConstImageView &image, int &x1, int &y1, int &x2, int &y2, int threads = 0);
+bool GetContentBounds(const ConstImageView &image, int &x1, int &y1, int &x2, int &y2, int threads = 0);
+
+// An image of compact pixels, from PixelFormats.h.  These take a half or a quarter of the
+// memory of an Image, and are read and written directly by the mosaic.
+template<typename Pixel>
+class PixelImage
+{
+public:
+    int width = 1, height = 1;
+    BufferVector<Pixel> pixels;
+
+    // Set the size, and allocate and zero the pixels.  On NUMA systems, its rows are spread
+    // across nodes.
+    void Alloc(int width, int height);
+    Pixel &ptr(int x, int y) { return pixels[size_t(y)*width + x]; }
+    const Pixel &ptr(int x, int y) const { return pixels[size_t(y)*width + x]; }
+
+    BasicImageView<Pixel> GetView() { return BasicImageView<Pixel>(pixels.data(), width, height, width); }
+    BasicImageView<const Pixel> GetView() const { return BasicImageView<const Pixel>(pixels.data(), width, height, width); }
+};
+
+typedef PixelImage<Rgba8> Image8;
+typedef PixelImage<Rgba16> Image16;
+typedef PixelImage<RgbaHalf> ImageHalf;
+
+// An image with any number of channels, such as a render with extra passes.  The first
+// four channels are a normal premultiplied RGBA image, and its alpha is the alpha of every
+// channel: the other channels are premultiplied by it too, as in OpenEXR.
+//
+// Channels are stored in groups of four, each group in its own Image, so each group can be
+// worked on like an RGBA image.  The first group is the RGBA image.  If the number of
+// channels isn't a multiple of four, the last group is padded with unused channels.
+//
+// Channels that aren't colors, such as depth or object IDs, can't be averaged, so they go
+// in groups after the color groups, and are passed through the mosaic unchanged.
+class MultiChannelImage
+{
+public:
+    int width = 1, height = 1;
+    int channels = 4;
+    vector<Image> groups;
+
+    // The number of groups of colors, starting with the first.  Only these are mosaiced.
+    int color_groups = 1;
+
+    // The name of each channel, for formats that name them.  This is empty if they aren't
+    // named.  Channels of the first group that a file doesn't have, and padding before
+    // the groups that aren't colors, are named "".
+    vector<string> channel_names;
+
+    // The type each channel had in the file it was read from, so it's written back the
+    // same way.  This is empty if the format only has one type.  Half channels are stored
+    // as floats.  UInt channels after the color groups are stored as their bits, so IDs are
+    // kept exactly.
+    enum class ChannelType { Float, Half, UInt };
+    vector<ChannelType> channel_types;
+
+    // Allocate and zero the image, with every group holding colors.  channels is at least 4.
+    void Alloc(int width, int height, int channels);
+
+    float &channel(int c, int x, int y) { return groups[c / 4].ptr(x, y)[c % 4]; }
+    float channel(int c, int x, int y) const { return groups[c / 4].ptr(x, y)[c % 4]; }
+
+    // Return a view of each group of colors, for Mosaic::ApplyMosaicLayers.
+    vector<ImageView> GetColorGroupViews();
+};
+
 #endif
@@ -1,6 +1,12 @@
-#include "mosaic.h"
+#include "Mosaic.h"
+#include "TileOccupancy.h"
+#include "ThreadPool.h"
+#include "Vec4fKernels.h"
 #include <math.h>
+#include <stdint.h>
+#include <limits.h>
 #include <algorithm>
+#include <functional>
 
 #ifndef M_PI
 #define M_PI 3.1415926535897932384626433832795
@@ -15,139 +21,2579 @@ bool Mosaic::Options::operator==(const Options &rhs) const
         origin_y == rhs.origin_y;
 }
 
-// This is like a very small subset of vector<>, but with automatic
-// allocation of out-of-range accesses.  Negative indices are allowed.
-// We expect data to be relatively contiguous and allocate the entire
-// range that's been accessed (this isn't a map), and always allocate
-// around 0.
-template<typename T>
-class autovector
+// One coordinate of the rotated grid, in bucket units, as 32.32 fixed point.  The mapping
+// is linear, so the coordinate of pixel (x, y) is start + x*step_x + y*step_y.  This is
+// exact integer math, so stepping along a row gives exactly the same result as computing
+// any pixel directly, no matter how far we step.
+struct FixedPointAxis
 {
-public:
-    autovector(T default_value = T())
+    static const int64_t one = int64_t(1) << 32;
+
+    int64_t start = 0, step_x = 0, step_y = 0;
+
+    FixedPointAxis() { }
+    FixedPointAxis(double start_, double step_x_, double step_y_):
+        start(llround(start_ * one)),
+        step_x(llround(step_x_ * one)),
+        step_y(llround(step_y_ * one))
     {
-        this->default_value = default_value;
+        init_spans();
     }
-    // Make sure element n is allocated.
-    void check(int n)
+
+    int64_t at(int x, int y) const { return start + x*step_x + y*step_y; }
+
+    // Return the bucket a coordinate is in.  This relies on >> of a negative number
+    // being an arithmetic shift, which is true of every compiler we build with.
+    static int bucket(int64_t value) { return int(value >> 32); }
+
+    // Return the number of steps of step_x we can take from value before we
+    // leave its bucket.
+    int64_t steps_in_bucket(int64_t value) const
     {
-        if(n >= start && n < end)
-            return;
+        int64_t bucket_start = bucket(value) * one;
+        if(step_x > 0)
+            return (bucket_start + one - value + step_x - 1) / step_x;
+        if(step_x < 0)
+            return (value - bucket_start) / -step_x + 1;
+        return INT64_MAX;
+    }
 
-        if(n < start)
+    // ceil(n / d) for a positive d, as a quotient and remainder, so it can be updated as
+    // n changes without dividing again.  remainder is quotient*d - n, and is in [0, d).
+    struct CeilDiv
+    {
+        int64_t quotient = 0, remainder = 0;
+
+        CeilDiv() { }
+        CeilDiv(int64_t n, int64_t d)
         {
-            int elements_to_add_at_beginning = start - n;
-            data.insert(data.begin(), elements_to_add_at_beginning, default_value);
-            start = n;
+            quotient = ceil_div(n, d);
+            remainder = quotient*d - n;
         }
-        else
+
+        // Add the n of another CeilDiv with the same d to this one.
+        void add(const CeilDiv &rhs, int64_t d)
+        {
+            quotient += rhs.quotient;
+            remainder += rhs.remainder;
+            if(remainder >= d)
+            {
+                quotient--;
+                remainder -= d;
+            }
+        }
+    };
+
+    // Find the range of x whose coordinate is in one bucket, for each row in turn.  The
+    // range may be empty.
+    //
+    // Each end of the range is ceil(n / step_x) for some n that changes by the same amount
+    // on each row, and the end is one bucket further than the start, so after the first
+    // row this is just additions.
+    class SpanWalker
+    {
+    public:
+        SpanWalker(const FixedPointAxis &axis_, int bucket, int y):
+            axis(axis_)
+        {
+            int64_t row_start = axis.at(0, y);
+            int64_t bucket_start = bucket * one;
+            if(axis.step_x > 0)
+            {
+                // row_start + x*step_x >= bucket_start, and < bucket_start + one.
+                x_start = CeilDiv(bucket_start - row_start, axis.step_x);
+            }
+            else if(axis.step_x < 0)
+            {
+                // The same, with the direction of the row reversed.  floor(n / d) + 1 is
+                // ceil((n - d + 1) / d) + 1.
+                x_start = CeilDiv(row_start - bucket_start - one + axis.step_x + 1, -axis.step_x);
+            }
+            else
+            {
+                // The coordinate doesn't change along the row, so each row is either
+                // entirely inside the bucket or entirely outside it.
+                constant_row_start = row_start;
+                constant_bucket_start = bucket_start;
+                return;
+            }
+
+            x_end = x_start;
+            x_end.add(axis.span_width, axis.span_divisor);
+        }
+
+        int64_t start() const
+        {
+            if(axis.step_x == 0)
+                return 0;
+            return x_start.quotient + axis.span_bias;
+        }
+
+        int64_t end() const
         {
-            int elements_to_add_at_end = n - end + 1;
-            data.insert(data.end(), elements_to_add_at_end, default_value);
-            end = n + 1;
+            if(axis.step_x == 0)
+            {
+                bool inside = constant_row_start >= constant_bucket_start && constant_row_start - constant_bucket_start < one;
+                return inside? INT_MAX:0;
+            }
+            return x_end.quotient + axis.span_bias;
+        }
+
+        void next_row()
+        {
+            if(axis.step_x == 0)
+            {
+                constant_row_start += axis.step_y;
+                return;
+            }
+
+            x_start.add(axis.span_row_step, axis.span_divisor);
+            x_end.add(axis.span_row_step, axis.span_divisor);
         }
+
+    private:
+        const FixedPointAxis &axis;
+        CeilDiv x_start, x_end;
+        int64_t constant_row_start = 0, constant_bucket_start = 0;
+    };
+
+    // Set up the constants used by SpanWalker.
+    void init_spans()
+    {
+        if(step_x == 0)
+            return;
+
+        // When step_x is negative, SpanWalker divides by -step_x and counts n the other way.
+        span_divisor = step_x > 0? step_x:-step_x;
+        span_row_step = CeilDiv(step_x > 0? -step_y:step_y, span_divisor);
+        span_width = CeilDiv(one, span_divisor);
+        span_bias = step_x > 0? 0:1;
     }
 
-    T &operator[](int n)
+    int64_t span_divisor = 1, span_bias = 0;
+    CeilDiv span_row_step, span_width;
+
+    static int64_t floor_div(int64_t a, int64_t b)
     {
-        check(n);
-        return data[n - start];
+        int64_t result = a / b;
+        if((a % b != 0) && ((a < 0) != (b < 0)))
+            result--;
+        return result;
     }
 
-    int start = 0, end = 0;
-private:
-    T default_value;
-    vector<T> data;
+    static int64_t ceil_div(int64_t a, int64_t b) { return -floor_div(-a, b); }
+};
+
+// The sum of a bucket in double precision.  A float sum of a large block loses most of
+// the precision of the pixels added last, so large blocks sum in doubles.
+struct BucketSum
+{
+    double x = 0, y = 0, z = 0, w = 0;
+
+    void add(const Vec4f &rhs) { x += rhs.x; y += rhs.y; z += rhs.z; w += rhs.w; }
+    void add(const BucketSum &rhs) { x += rhs.x; y += rhs.y; z += rhs.z; w += rhs.w; }
+    Vec4f get() const { return Vec4f(float(x), float(y), float(z), float(w)); }
+};
+
+// The sum of a bucket of 8-bit pixels in integers.  Color is summed as color times alpha,
+// so each pixel adds up to 255*255 to a color channel, and 32 bits holds the sum of 66051
+// pixels.  After normalizing, r, g and b are the bucket's 8-bit color.
+struct IntBucketSum
+{
+    uint32_t r = 0, g = 0, b = 0, a = 0;
+
+    void add(const IntBucketSum &rhs) { r += rhs.r; g += rhs.g; b += rhs.b; a += rhs.a; }
+};
+
+// Memory used while rendering that can be kept from one render to the next.  ColorBuckets
+// borrows the bucket storage while it renders, so the vectors keep their capacity and
+// later renders don't allocate and fault in the same memory again.
+struct RenderBuffers
+{
+    BufferVector<Vec4f> buckets;
+    BufferVector<BucketSum> sums;
+    BufferVector<IntBucketSum> int_sums;
+    vector<int> tile_slots;
+    TileOccupancy occupancy;
+
+    size_t get_memory_usage() const
+    {
+        return buckets.capacity() * sizeof(Vec4f) +
+            sums.capacity() * sizeof(BucketSum) +
+            int_sums.capacity() * sizeof(IntBucketSum) +
+            tile_slots.capacity() * sizeof(int) +
+            occupancy.GetMemoryUsage();
+    }
 };
 
 // Map from pixels in the image to buckets to combine, and handle
 // rotation and other transformations.
+//
+// Buckets are stored in a single dense grid.  The mapping from pixels to buckets
+// is linear, so the range of buckets the image can touch is bounded by the buckets
+// of its four corners, and we can size the whole grid up front.
+//
+// If the image is only part of a larger image, image_x and image_y are the position
+// of its top-left pixel in the larger image.  Pixels map to the same buckets they
+// would in the larger image, and the grid only covers the part.
 class ColorBuckets
 {
 public:
-    ColorBuckets(float block_size_, float angle_, int origin_x_, int origin_y_):
-        buckets(autovector<Vec4f>(Vec4f(0,0,0,0))),
+    ColorBuckets(int image_width, int image_height, float block_size_, float angle_, int origin_x_, int origin_y_, int image_x_ = 0, int image_y_ = 0):
         block_size(max(1.0f, block_size_)),
-        origin_x(origin_x_), origin_y(origin_y_),
-        angle(-float(angle_ / 180 * M_PI))
+        origin_x(origin_x_ - image_x_), origin_y(origin_y_ - image_y_),
+        image_x(image_x_), image_y(image_y_),
+        angle(-float(angle_ / 180 * M_PI)),
+        angle_degrees(angle_)
+    {
+        // Multiples of 90 degrees are common, so handle them exactly.  cosf and sinf
+        // won't give exactly 0 or 1 for them, which skews the grid very slightly.
+        float quarter_turns = angle_ / 90;
+        if(quarter_turns == floorf(quarter_turns) && fabsf(quarter_turns) < 1e6f)
+        {
+            static const float cos_table[] = { 1, 0, -1, 0 };
+            static const float sin_table[] = { 0, -1, 0, 1 };
+            int quadrant = int(fmodf(quarter_turns, 4));
+            if(quadrant < 0)
+                quadrant += 4;
+            cos_angle = cos_table[quadrant];
+            sin_angle = sin_table[quadrant];
+            axis_aligned = true;
+            swap_axes = (quadrant % 2) == 1;
+        }
+        else
+        {
+            cos_angle = cosf(angle);
+            sin_angle = sinf(angle);
+
+            // Set up the fixed-point mapping for rotated grids.  This is the same as
+            // get_bucket_coord, expanded into start + x*step_x + y*step_y.
+            double radians = -double(angle_degrees) / 180 * M_PI;
+            //
+            // This is done in the coordinates of the larger image, then moved to the part,
+            // so the fixed-point values are exactly the same as for the larger image.
+            double c = cos(radians) / block_size, s = sin(radians) / block_size;
+            fixed_x = FixedPointAxis(-c*origin_x_ + s*origin_y_,  c, -s);
+            fixed_y = FixedPointAxis(-c*origin_y_ - s*origin_x_,  s,  c);
+            fixed_x.start = fixed_x.at(image_x_, image_y_);
+            fixed_y.start = fixed_y.at(image_x_, image_y_);
+        }
+
+        fit_grid(0, 0, image_width, image_height);
+    }
+
+    // Size the grid to hold the buckets of the pixels in [x1,x2) x [y1,y2).  Pixels
+    // outside of that go to the nearest bucket on the edge of the grid, so they must not
+    // be summed.
+    void fit_grid(int x1, int y1, int x2, int y2)
+    {
+        int right = max(x2-1, x1);
+        int bottom = max(y2-1, y1);
+        pair<int,int> corners[] = {
+            get_bucket_index(x1, y1),
+            get_bucket_index(right, y1),
+            get_bucket_index(x1, bottom),
+            get_bucket_index(right, bottom),
+        };
+
+        int min_x = corners[0].first, max_x = corners[0].first;
+        int min_y = corners[0].second, max_y = corners[0].second;
+        for(const pair<int,int> &corner: corners)
+        {
+            min_x = min(min_x, corner.first);
+            max_x = max(max_x, corner.first);
+            min_y = min(min_y, corner.second);
+            max_y = max(max_y, corner.second);
+        }
+
+        // Leave a bucket of slack on each side.  Rounding error can put a pixel near an
+        // edge one bucket past the bucket of the nearest corner.
+        grid_x = min_x - 1;
+        grid_y = min_y - 1;
+        grid_width = max_x - min_x + 3;
+        grid_height = max_y - min_y + 3;
+    }
+
+    // Allocate the grid.  This isn't needed by block-major traversal, which doesn't store
+    // buckets.  The layout changes offsets, so this must be called before finding any
+    // offsets with get_bucket_offset.  The grid is cleared using up to threads threads.
+    void allocate(Mosaic::BucketLayout layout_ = Mosaic::BucketLayout::RowMajor, int threads = 0)
+    {
+        tile_slots.clear();
+        tiles_x = (grid_width + TileSize - 1) / TileSize;
+        tiles_y = (grid_height + TileSize - 1) / TileSize;
+        if(layout_ == Mosaic::BucketLayout::Tiled)
+        {
+            layout = Layout::Tiled;
+            clear_storage(size_t(tiles_x) * tiles_y * TileSize * TileSize, threads);
+        }
+        else
+        {
+            layout = Layout::RowMajor;
+            clear_storage(size_t(grid_width)*grid_height, threads);
+        }
+    }
+
+    // Allocate sparse storage, with only the tiles of buckets that pixels in occupied tiles
+    // of occupancy can go to.  occupancy must be for an image of the given size.  If most
+    // tiles are needed anyway, leave the grid unallocated and return false.
+    bool allocate_sparse(const TileOccupancy &occupancy, int image_width, int image_height, int threads = 0)
+    {
+        int bucket_tiles_x = (grid_width + TileSize - 1) / TileSize;
+        int bucket_tiles_y = (grid_height + TileSize - 1) / TileSize;
+        vector<uint8_t> used(size_t(bucket_tiles_x) * bucket_tiles_y, 0);
+
+        // Mark the bucket tiles each occupied pixel tile can reach.  The mapping is linear,
+        // so those are bounded by the buckets of the tile's corners, plus a bucket of slack
+        // for rounding.  Clamping to the grid is the same as get_bucket_offset.
+        for(int tile_y = 0; tile_y < occupancy.tiles_y; ++tile_y)
+        {
+            for(int tile_x = 0; tile_x < occupancy.tiles_x; ++tile_x)
+            {
+                if(!occupancy.IsTileOccupied(tile_x, tile_y))
+                    continue;
+
+                int x1 = tile_x * TileOccupancy::TileSize;
+                int y1 = tile_y * TileOccupancy::TileSize;
+                int x2 = min(x1 + TileOccupancy::TileSize, image_width) - 1;
+                int y2 = min(y1 + TileOccupancy::TileSize, image_height) - 1;
+                pair<int,int> corners[] = {
+                    get_bucket_index(x1, y1), get_bucket_index(x2, y1),
+                    get_bucket_index(x1, y2), get_bucket_index(x2, y2),
+                };
+
+                int min_x = INT_MAX, min_y = INT_MAX, max_x = INT_MIN, max_y = INT_MIN;
+                for(const pair<int,int> &corner: corners)
+                {
+                    min_x = min(min_x, corner.first);
+                    max_x = max(max_x, corner.first);
+                    min_y = min(min_y, corner.second);
+                    max_y = max(max_y, corner.second);
+                }
+
+                min_x = min(max(min_x - 1 - grid_x, 0), grid_width-1) / TileSize;
+                max_x = min(max(max_x + 1 - grid_x, 0), grid_width-1) / TileSize;
+                min_y = min(max(min_y - 1 - grid_y, 0), grid_height-1) / TileSize;
+                max_y = min(max(max_y + 1 - grid_y, 0), grid_height-1) / TileSize;
+                for(int y = min_y; y <= max_y; ++y)
+                    for(int x = min_x; x <= max_x; ++x)
+                        used[y*bucket_tiles_x + x] = 1;
+            }
+        }
+
+        size_t used_tiles = count(used.begin(), used.end(), 1);
+        if(used_tiles * 4 > used.size())
+            return false;
+
+        // Slot 0 is a spare tile of zeroes for tiles that aren't used.  Nothing should ever
+        // use it, but this way a mistake won't write outside of the storage.
+        layout = Layout::Sparse;
+        tiles_x = bucket_tiles_x;
+        tiles_y = bucket_tiles_y;
+        tile_slots.assign(used.size(), 0);
+        int next_slot = 1;
+        for(size_t i = 0; i < used.size(); ++i)
+        {
+            if(used[i])
+                tile_slots[i] = next_slot++;
+        }
+
+        clear_storage(size_t(next_slot) * TileSize * TileSize, threads);
+        return true;
+    }
+
+    // Size buckets to count zeroed buckets of each layer, and sums to match if blocks are
+    // large enough to need them.  Smaller blocks don't lose much precision in float, and have more buckets,
+    // so doubles would cost more memory and time than they're worth.  With integer sums,
+    // only int_sums is used.
+    //
+    // The storage is cleared in parallel, in the order bands of the image sum into it.
+    // The first thread to touch a page decides which NUMA node it's on, so this keeps each
+    // part of the grid on the node of the threads that will mostly use it.
+    void clear_storage(size_t count, int threads)
+    {
+        const float min_double_block_size = 32;
+        bool use_sums = block_size >= min_double_block_size && !integer_sums;
+        count *= layers;
+
+        buckets.clear();
+        if(!integer_sums)
+            ResizeUninitialized(buckets, count);
+        sums.clear();
+        if(use_sums)
+            ResizeUninitialized(sums, count);
+        int_sums.clear();
+        if(integer_sums)
+            ResizeUninitialized(int_sums, count);
+
+        const size_t chunk_size = 16*1024;
+        ThreadPool::Get().ParallelFor(int((count + chunk_size - 1) / chunk_size), threads, [&](int chunk) {
+            size_t start = chunk * chunk_size;
+            size_t end = min(start + chunk_size, count);
+            if(integer_sums)
+            {
+                fill(int_sums.begin() + start, int_sums.begin() + end, IntBucketSum());
+                return;
+            }
+
+            fill(buckets.begin() + start, buckets.begin() + end, Vec4f(0,0,0,0));
+            if(use_sums)
+                fill(sums.begin() + start, sums.begin() + end, BucketSum());
+        });
+    }
+
+    // Exchange the bucket storage with buffers.  This is used to borrow the storage of
+    // buffers while rendering, and give it back afterwards.
+    void swap_storage(RenderBuffers &buffers)
+    {
+        buckets.swap(buffers.buckets);
+        sums.swap(buffers.sums);
+        int_sums.swap(buffers.int_sums);
+        tile_slots.swap(buffers.tile_slots);
+    }
+
+    // Return the index in buckets of an offset from get_bucket_offset.  With more than one
+    // layer, this is the index of the bucket's first layer.
+    size_t get_index(int offset) const
+    {
+        size_t index = offset;
+        if(layout == Layout::Sparse)
+        {
+            int slot = tile_slots[offset >> (TileBits*2)];
+            index = (size_t(slot) << (TileBits*2)) + (offset & (TileSize*TileSize - 1));
+        }
+        return index * layers;
+    }
+
+    // Return the bucket at an offset from get_bucket_offset, in the first layer.
+    Vec4f &get_bucket(int offset) { return buckets[get_index(offset)]; }
+    const Vec4f &get_bucket(int offset) const { return buckets[get_index(offset)]; }
+
+    // Add the sum of one row of a bucket's pixels to the bucket.
+    void add_sum(int offset, const Vec4f &row_sum, int layer = 0)
+    {
+        size_t index = get_index(offset) + layer;
+        if(sums.empty())
+            buckets[index] += row_sum;
+        else
+            sums[index].add(row_sum);
+    }
+
+    // Add the integer sum of one row of a bucket's pixels to the bucket.
+    void add_sum(int offset, const IntBucketSum &row_sum)
+    {
+        int_sums[get_index(offset)].add(row_sum);
+    }
+
+    // Return the integer sum at an offset from get_bucket_offset.
+    const IntBucketSum &get_int_sum(int offset) const { return int_sums[get_index(offset)]; }
+
+    // If we're summing in doubles, store the sums in buckets.  This is called before
+    // normalizing, on the range [start, end) of buckets.
+    void store_sums(size_t start, size_t end)
     {
+        if(sums.empty())
+            return;
+        for(size_t i = start; i < end; ++i)
+            buckets[i] = sums[i].get();
     }
 
-    pair<float,float> get_bucket_coord(int x, int y)
+    pair<float,float> get_bucket_coord(int x, int y) const
     {
         x -= origin_x;
         y -= origin_y;
 
         // Rotate the position.
-        float result_x = cosf(angle)*x - sinf(angle)*y;
-        float result_y = cosf(angle)*y + sinf(angle)*x;
+        float result_x = cos_angle*x - sin_angle*y;
+        float result_y = cos_angle*y + sin_angle*x;
 
         result_x /= block_size;
         result_y /= block_size;
         return make_pair(result_x, result_y);
     }
 
-    Vec4f &get_bucket(int x, int y)
+    pair<int,int> get_bucket_index(int x, int y) const
     {
+        if(!axis_aligned)
+        {
+            return make_pair(
+                FixedPointAxis::bucket(fixed_x.at(x, y)),
+                FixedPointAxis::bucket(fixed_y.at(x, y)));
+        }
+
         pair<float,float> coord = get_bucket_coord(x, y);
-        x = int(floorf(coord.first));
-        y = int(floorf(coord.second));
-        return buckets[x][y];
-    };
+        return make_pair(int(floorf(coord.first)), int(floorf(coord.second)));
+    }
+
+    // Divide the image into bands of rows to sum in parallel.  Bands are at least as tall
+    // as a block, so a bucket never has pixels in more than two neighboring bands, and
+    // we can sum all even bands at once, then all odd bands.  The bands only depend on
+    // the image size and grid, not the number of threads, so the result doesn't either.
+    //
+    // Return the first row of each band, followed by the image height.
+    //
+    // Rotated bands are anchored to rows of the larger image, so a part of it sums each
+    // bucket's rows in the same order as the whole image.  If the first band is odd in the
+    // larger image, it's preceded by an empty band, so even bands are even in both.
+    vector<int> get_band_starts(int image_height) const
+    {
+        int block_rows = int(ceilf(block_size * (fabsf(cos_angle) + fabsf(sin_angle)))) + 2;
+        int band_height = max(block_rows, 32);
+
+        vector<int> band_starts;
+        if(axis_aligned)
+        {
+            // Start bands on bucket boundaries, so each bucket is in only one band.
+            int last_bucket = 0;
+            for(int y = 0; y < image_height; ++y)
+            {
+                pair<int,int> idx = get_bucket_index(origin_x, y);
+                int bucket = swap_axes? idx.first:idx.second;
+                if(band_starts.empty() || (y - band_starts.back() >= band_height && bucket != last_bucket))
+                    band_starts.push_back(y);
+                last_bucket = bucket;
+            }
+        }
+        else
+        {
+            int first_band = int(FixedPointAxis::floor_div(image_y, band_height));
+            if(first_band & 1)
+                band_starts.push_back(0);
+            for(int band = first_band; band * band_height - image_y < image_height; ++band)
+                band_starts.push_back(max(band * band_height - image_y, 0));
+        }
+
+        band_starts.push_back(image_height);
+        return band_starts;
+    }
+
+    // Return the offset of the bucket at the given bucket index, for get_bucket.
+    //
+    // With tiled and sparse storage, the offset is the bucket's tile, followed by its
+    // position in the tile.  The X and Y parts of the offset are in separate bits, so like
+    // row-major offsets, the offset of (x, y) is the offset of (x, 0) plus the offset of
+    // (0, y).
+    int get_bucket_offset(int bucket_x, int bucket_y) const
+    {
+        bucket_x = min(max(bucket_x - grid_x, 0), grid_width-1);
+        bucket_y = min(max(bucket_y - grid_y, 0), grid_height-1);
+        if(layout == Layout::RowMajor)
+            return bucket_y*grid_width + bucket_x;
+
+        const int mask = TileSize - 1;
+        int tile = (bucket_y >> TileBits) * tiles_x + (bucket_x >> TileBits);
+        return (tile << (TileBits*2)) + ((bucket_y & mask) << TileBits) + (bucket_x & mask);
+    }
+
+    // How buckets are stored:
+    //
+    // RowMajor: bucket (grid_x, grid_y) is at buckets[0], followed by the rest of the grid
+    // in rows.
+    //
+    // Tiled: the grid is divided into tiles of TileSize x TileSize buckets, and each tile
+    // is stored together, so buckets that are near each other in the image are near each
+    // other in memory.
+    //
+    // Sparse: the grid is tiled, but buckets holds only the tiles that are used, in the
+    // slots given by tile_slots.
+    enum class Layout { RowMajor, Tiled, Sparse };
+
+    // The number of images summed with the same mapping.  Each bucket has a color for
+    // each layer, stored together.  This must be set before allocating.
+    int layers = 1;
+
+    // If true, 8-bit pixels are summed in int_sums instead of buckets.  This must be set
+    // before allocating.
+    bool integer_sums = false;
+
+    BufferVector<Vec4f> buckets;
+
+    // If blocks are large, the double-precision sum of each bucket, stored the same way as
+    // buckets.  Otherwise, this is empty and buckets are summed in place.
+    BufferVector<BucketSum> sums;
+
+    // If integer_sums is true, the integer sum of each bucket, stored the same way as
+    // buckets.  buckets is empty.
+    BufferVector<IntBucketSum> int_sums;
+
+    int grid_x = 0, grid_y = 0;
+    int grid_width = 0, grid_height = 0;
+
+    static const int TileBits = 4;
+    static const int TileSize = 1 << TileBits;
+    Layout layout = Layout::RowMajor;
+    int tiles_x = 0, tiles_y = 0;
+    vector<int> tile_slots;
 
-    autovector<autovector<Vec4f>> buckets;
     float block_size = 1;
-    float angle = 0;
     int origin_x = 0, origin_y = 0;
+    int image_x = 0, image_y = 0;
+    float angle = 0;
+    float angle_degrees = 0;
+    float cos_angle = 1, sin_angle = 0;
+
+    // If true, the angle is a multiple of 90 degrees, so one bucket coordinate depends
+    // only on the column and the other only on the row.  If swap_axes is false, the
+    // column gives the bucket X coordinate, otherwise it gives the bucket Y coordinate.
+    bool axis_aligned = false;
+    bool swap_axes = false;
+
+    // If the grid isn't axis-aligned, the fixed-point mapping to bucket coordinates.
+    FixedPointAxis fixed_x, fixed_y;
 };
 
-namespace Mosaic
+// Lend the bucket storage of buffers to color_buckets while this is in scope.
+class BorrowedStorage
 {
-    void ApplyMosaic(Image &image, const Options &options)
+public:
+    BorrowedStorage(ColorBuckets &color_buckets_, RenderBuffers &buffers_):
+        color_buckets(color_buckets_), buffers(buffers_)
+    {
+        color_buckets.swap_storage(buffers);
+    }
+
+    ~BorrowedStorage()
+    {
+        color_buckets.swap_storage(buffers);
+    }
+
+private:
+    BorrowedStorage(const BorrowedStorage &) = delete;
+    BorrowedStorage &operator=(const BorrowedStorage &) = delete;
+
+    ColorBuckets &color_buckets;
+    RenderBuffers &buffers;
+};
+
+// When the grid is axis-aligned, each row of the image is made of runs of pixels that
+// all go to the same bucket, and the runs are in the same place on every row.  Store
+// the runs, and the offset into the bucket grid for each row, so we can work on whole
+// runs at a time.
+//
+// This uses the same calculations as ColorBuckets::get_bucket_index.
+class AxisAlignedRuns
+{
+public:
+    struct Run
     {
-        // Break the image up into buckets, and sum the color in each bucket.
-        ColorBuckets color_buckets(options.block_size, options.angle, options.origin_x, options.origin_y);
+        int x_start, x_end;
+        int offset;
+    };
 
-        for(int y = 0; y < image.height; y++)
+    AxisAlignedRuns(const ColorBuckets &color_buckets, int image_width, int image_height)
+    {
+        // Find the bucket offset of each column, and divide the row into runs.
+        for(int x = 0; x < image_width; ++x)
         {
-            for(int x = 0; x < image.width; x++)
-            {
-                Vec4f &color = color_buckets.get_bucket(x, y);
+            pair<int,int> idx = color_buckets.get_bucket_index(x, color_buckets.origin_y);
+            int offset = color_buckets.swap_axes?
+                color_buckets.get_bucket_offset(color_buckets.grid_x, idx.second):
+                color_buckets.get_bucket_offset(idx.first, color_buckets.grid_y);
 
-                // Sum the color in this block.  The data is premultiplied, so this
-                // will weight by alpha, making transparent pixels contribute less to
-                // the color of the block than opaque ones.
-                color += image.rgba[y*image.width + x];
-            }
+            if(!runs.empty() && runs.back().offset == offset)
+                runs.back().x_end = x+1;
+            else
+                runs.push_back({ x, x+1, offset });
         }
 
-        // Except for completely transparent buckets, make all buckets completely opaque.
-        for(int bucket_y = color_buckets.buckets.start; bucket_y < color_buckets.buckets.end; ++bucket_y)
+        // Find the bucket offset of each row.
+        row_offsets.resize(image_height);
+        for(int y = 0; y < image_height; ++y)
         {
-            autovector<Vec4f> &row_buckets = color_buckets.buckets[bucket_y];
-            for(int bucket_x = row_buckets.start; bucket_x < row_buckets.end; ++bucket_x)
-            {
-                Vec4f &color = row_buckets[bucket_x];
-                if(color.w < 0.01)
-                    color = Vec4f(0,0,0,0);
-                else
-                    color *= 1.0f/color.w;
-            }
+            pair<int,int> idx = color_buckets.get_bucket_index(color_buckets.origin_x, y);
+            row_offsets[y] = color_buckets.swap_axes?
+                color_buckets.get_bucket_offset(idx.first, color_buckets.grid_y):
+                color_buckets.get_bucket_offset(color_buckets.grid_x, idx.second);
+        }
+    }
+
+    // Call f(x_start, x_end, offset) for each run of pixels in row y between x_begin and
+    // x_end that go to the same bucket.  Runs are clipped to [x_begin, x_end).
+    template<typename Func>
+    void for_each_run(int y, int x_begin, int x_end, Func f) const
+    {
+        int row_offset = row_offsets[y];
+        auto it = upper_bound(runs.begin(), runs.end(), x_begin, [](int x, const Run &run) { return x < run.x_end; });
+        for(; it != runs.end() && it->x_start < x_end; ++it)
+            f(max(it->x_start, x_begin), min(it->x_end, x_end), row_offset + it->offset);
+    }
+
+    vector<Run> runs;
+    vector<int> row_offsets;
+};
+
+// When the grid is rotated, step along each row in fixed point.  Rather than stepping
+// one pixel at a time, we find how many steps we can take before either coordinate
+// leaves its bucket, which gives the same result as stepping pixel by pixel.
+class RotatedRuns
+{
+public:
+    RotatedRuns(const ColorBuckets &color_buckets_, int image_width_):
+        color_buckets(color_buckets_),
+        image_width(image_width_)
+    {
+    }
+
+    template<typename Func>
+    void for_each_run(int y, int x_begin, int x_end, Func f) const
+    {
+        const FixedPointAxis &fixed_x = color_buckets.fixed_x;
+        const FixedPointAxis &fixed_y = color_buckets.fixed_y;
+        int64_t u = fixed_x.at(x_begin, y);
+        int64_t v = fixed_y.at(x_begin, y);
+
+        int x = x_begin;
+        while(x < x_end)
+        {
+            int64_t steps = min(fixed_x.steps_in_bucket(u), fixed_y.steps_in_bucket(v));
+            int run_end = int(min(int64_t(x_end), x + steps));
+            int offset = color_buckets.get_bucket_offset(FixedPointAxis::bucket(u), FixedPointAxis::bucket(v));
+            f(x, run_end, offset);
+
+            u += (run_end - x) * fixed_x.step_x;
+            v += (run_end - x) * fixed_y.step_x;
+            x = run_end;
         }
+    }
+
+    const ColorBuckets &color_buckets;
+    int image_width;
+};
+
+// Read runs from a Mosaic::Plan.
+class PlanRuns
+{
+public:
+    PlanRuns(const Mosaic::Plan &plan_):
+        plan(plan_)
+    {
+    }
+
+    template<typename Func>
+    void for_each_run(int y, int x_begin, int x_end, Func f) const
+    {
+        const Mosaic::Plan::Run *row_begin = plan.runs.data() + plan.row_starts[y];
+        const Mosaic::Plan::Run *row_end = plan.runs.data() + plan.row_starts[y+1];
+        const Mosaic::Plan::Run *run = upper_bound(row_begin, row_end, x_begin,
+            [](int x, const Mosaic::Plan::Run &r) { return x < r.x_end; });
 
-        // Copy the color from the buckets back to the image.
-        for(int y = 0; y < image.height; y++)
+        int x = run == row_begin? 0:run[-1].x_end;
+        for(; run != row_end && x < x_end; ++run)
         {
-            for(int x = 0; x < image.width; x++)
-            {
-                // Write the pixel from its color bucket.  Leave the alpha value in the destination
-                // alone, and multiply the color by alpha since our color is premultiplied.
-                Vec4f color = color_buckets.get_bucket(x, y);
-                Vec4f &output = image.rgba[y*image.width + x];
-                output.x = color.x * output.w;
-                output.y = color.y * output.w;
-                output.z = color.z * output.w;
-            }
+            f(max(x, x_begin), min(run->x_end, x_end), run->bucket);
+            x = run->x_end;
+        }
+    }
+
+    const Mosaic::Plan &plan;
+};
+
+namespace
+{
+    // Add a run of pixels to four lanes, like Vec4fKernels::SumLanesRun.  Compact pixels are
+    // converted to float as they're read, and go in the same lanes in the same order, so
+    // they sum exactly as the same pixels converted to Vec4f would.
+    inline void SumPixelLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+    {
+        Vec4fKernels::SumLanesRun(pixels, count, first_lane, lanes);
+    }
+
+    template<typename Pixel>
+    void SumPixelLanes(const Pixel *pixels, int count, int first_lane, Vec4f *lanes)
+    {
+        for(int i = 0; i < count; ++i)
+            lanes[(first_lane + i) & 3] += PixelTraits<Pixel>::Load(pixels[i]);
+    }
+
+    // Write a bucket's color to a run of pixels, like Vec4fKernels::WriteRun.
+    inline void WritePixelRun(Vec4f *pixels, int count, const Vec4f &color)
+    {
+        Vec4fKernels::WriteRun(pixels, count, color);
+    }
+
+    template<typename Pixel>
+    void WritePixelRun(Pixel *pixels, int count, const Vec4f &color)
+    {
+        typename PixelTraits<Pixel>::Writer writer(color);
+        for(int i = 0; i < count; ++i)
+            writer.Store(pixels[i]);
+    }
+}
+
+// Sum the runs of one row into buckets.  Each bucket's pixels on the row are summed in
+// four lanes by X coordinate in the larger image, then the lanes are added together
+// and to the bucket.  Runs of a bucket split by empty tiles or by the edge of a rectangle
+// add each pixel to the same lane, and empty pixels add nothing, so every way of
+// splitting a row gives exactly the same sums.
+//
+// Runs must be added in order along the row, and flush must be called at the end of it.
+class RowSummer
+{
+public:
+    RowSummer(ColorBuckets &color_buckets_):
+        color_buckets(color_buckets_)
+    {
+    }
+
+    template<typename Pixel>
+    void add(const Pixel *row, int x_start, int x_end, int offset)
+    {
+        if(offset != current_offset)
+        {
+            flush();
+            current_offset = offset;
         }
+
+        SumPixelLanes(row + x_start, x_end - x_start, (x_start + color_buckets.image_x) & 3, lanes);
+    }
+
+    void flush()
+    {
+        if(current_offset == -1)
+            return;
+
+        color_buckets.add_sum(current_offset, (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+        lanes[0] = lanes[1] = lanes[2] = lanes[3] = Vec4f(0,0,0,0);
+        current_offset = -1;
+    }
+
+private:
+    ColorBuckets &color_buckets;
+    int current_offset = -1;
+    Vec4f lanes[4];
+};
+
+// RowSummer for several layers that go to the same buckets.  Each layer is summed into its
+// own lanes exactly as RowSummer would sum it alone, so every layer gets the same sums it
+// would get if it was mosaiced by itself.
+class LayerRowSummer
+{
+public:
+    LayerRowSummer(ColorBuckets &color_buckets_):
+        color_buckets(color_buckets_),
+        lanes(color_buckets_.layers * 4)
+    {
     }
-};
\ No newline at end of file
+
+    // rows is the row of each layer.
+    void add(const Vec4f *const *rows, int x_start, int x_end, int offset)
+    {
+        if(offset != current_offset)
+        {
+            flush();
+            current_offset = offset;
+        }
+
+        int first_lane = (x_start + color_buckets.image_x) & 3;
+        for(int layer = 0; layer < color_buckets.layers; ++layer)
+            Vec4fKernels::SumLanesRun(rows[layer] + x_start, x_end - x_start, first_lane, &lanes[layer*4]);
+    }
+
+    void flush()
+    {
+        if(current_offset == -1)
+            return;
+
+        for(int layer = 0; layer < color_buckets.layers; ++layer)
+        {
+            Vec4f *layer_lanes = &lanes[layer*4];
+            color_buckets.add_sum(current_offset, (layer_lanes[0] + layer_lanes[1]) + (layer_lanes[2] + layer_lanes[3]), layer);
+            fill(layer_lanes, layer_lanes + 4, Vec4f(0,0,0,0));
+        }
+        current_offset = -1;
+    }
+
+private:
+    ColorBuckets &color_buckets;
+    int current_offset = -1;
+    vector<Vec4f> lanes;
+};
+
+// Apply the mosaic to a rotated grid one block at a time.  Each block is a rotated
+// square, and we scan-convert it: for each row it covers, the pixels inside both the
+// block's X and Y bucket ranges form one span.  We sum the spans in a local, normalize,
+// and write the color back over the same spans while they're still in cache.
+//
+// This uses the same fixed-point mapping as RotatedRuns, so pixels go to the same blocks.
+// The raster traversal sums bands of rows in two passes, so the sums may differ by
+// rounding.
+class BlockMajorRotated
+{
+public:
+    BlockMajorRotated(const ColorBuckets &color_buckets_):
+        color_buckets(color_buckets_)
+    {
+        // Find the size of a block in image space, so we can find the rows and columns
+        // each block might touch.  The mapping from bucket coordinates back to image
+        // coordinates is the inverse rotation.
+        double radians = -double(color_buckets.angle_degrees) / 180 * M_PI;
+        c = cos(radians) * color_buckets.block_size;
+        s = sin(radians) * color_buckets.block_size;
+    }
+
+    // Apply one row of blocks.  Blocks never share pixels, so rows can be applied
+    // in parallel.
+    void apply_row(const ImageView &image, const TileOccupancy &occupancy, int bucket_y)
+    {
+        for(int bucket_x = color_buckets.grid_x; bucket_x < color_buckets.grid_x + color_buckets.grid_width; ++bucket_x)
+            apply_block(image, occupancy, bucket_x, bucket_y);
+    }
+
+private:
+    // Get the image-space bounds of a block, padded by a pixel so rounding can't
+    // exclude pixels we need.
+    void get_block_bounds(int bucket_x, int bucket_y, int &x1, int &y1, int &x2, int &y2) const
+    {
+        double min_x = 1e30, min_y = 1e30, max_x = -1e30, max_y = -1e30;
+        for(int corner = 0; corner < 4; ++corner)
+        {
+            double u = bucket_x + (corner & 1);
+            double v = bucket_y + (corner >> 1);
+            double x = c*u + s*v + color_buckets.origin_x;
+            double y = -s*u + c*v + color_buckets.origin_y;
+            min_x = min(min_x, x);
+            max_x = max(max_x, x);
+            min_y = min(min_y, y);
+            max_y = max(max_y, y);
+        }
+
+        x1 = int(floor(min_x)) - 1;
+        y1 = int(floor(min_y)) - 1;
+        x2 = int(ceil(max_x)) + 2;
+        y2 = int(ceil(max_y)) + 2;
+    }
+
+    void apply_block(const ImageView &image, const TileOccupancy &occupancy, int bucket_x, int bucket_y)
+    {
+        int x1, y1, x2, y2;
+        get_block_bounds(bucket_x, bucket_y, x1, y1, x2, y2);
+        x1 = max(x1, 0);
+        y1 = max(y1, 0);
+        x2 = min(x2, image.width);
+        y2 = min(y2, image.height);
+        if(x1 >= x2 || y1 >= y2)
+            return;
+
+        // If the block is entirely in empty tiles, its color is zero, and writing it back
+        // wouldn't change anything.
+        if(!occupancy.IsAreaOccupied(x1, y1, x2, y2))
+            return;
+
+        // Find the span of the block on each row, and sum them, the same way as RowSummer.
+        spans.clear();
+        BucketSum sum;
+        FixedPointAxis::SpanWalker u_span(color_buckets.fixed_x, bucket_x, y1);
+        FixedPointAxis::SpanWalker v_span(color_buckets.fixed_y, bucket_y, y1);
+        for(int y = y1; y < y2; ++y, u_span.next_row(), v_span.next_row())
+        {
+            // Clamp both ends to [x1, x2] before narrowing.  Near 90 degrees the steps are
+            // tiny, and the spans can be far outside of int range.
+            int64_t start = max(u_span.start(), v_span.start());
+            int64_t end = min(u_span.end(), v_span.end());
+            int x_start = int(min(max(start, int64_t(x1)), int64_t(x2)));
+            int x_end = int(min(max(end, int64_t(x1)), int64_t(x2)));
+            if(x_start >= x_end)
+                continue;
+
+            spans.push_back(Span { y, x_start, x_end });
+
+            const Vec4f *row = image.row(y);
+            Vec4f lanes[4];
+            Vec4fKernels::SumLanesRun(row + x_start, x_end - x_start, (x_start + color_buckets.image_x) & 3, lanes);
+            sum.add((lanes[0] + lanes[1]) + (lanes[2] + lanes[3]));
+        }
+
+        if(spans.empty())
+            return;
+
+        // Except for completely transparent buckets, make all buckets completely opaque.
+        Vec4f color = sum.get();
+        Vec4fKernels::Normalize(&color, 1);
+
+        for(const Span &span: spans)
+        {
+            Vec4f *row = image.row(span.y);
+            Vec4fKernels::WriteRun(row + span.x_start, span.x_end - span.x_start, color);
+        }
+    }
+
+    struct Span
+    {
+        int y, x_start, x_end;
+    };
+
+    const ColorBuckets &color_buckets;
+    double c = 1, s = 0;
+    vector<Span> spans;
+};
+
+namespace
+{
+    int GetThreadCount(const Mosaic::Options &options)
+    {
+        if(options.threads > 0)
+            return options.threads;
+        return ThreadPool::Get().GetConcurrency();
+    }
+
+    // Call f(i) for each i in [0, count) on the shared thread pool, using up to the given
+    // number of threads.
+    void ParallelFor(int count, int threads, const function<void(int)> &f)
+    {
+        ThreadPool::Get().ParallelFor(count, threads, f);
+    }
+
+    // Find which tiles of the image have any pixels in them.
+    void ScanOccupancy(const ConstImageView &image, TileOccupancy &occupancy, int threads)
+    {
+        occupancy.Init(image.width, image.height);
+        ParallelFor(occupancy.tiles_y, threads, [&](int tile_y) {
+            occupancy.ScanTileRow(image, tile_y);
+        });
+    }
+
+    // Call f(x_start, x_end, offset) for each run on row y, skipping empty tiles.
+    template<typename Runs, typename Func>
+    void ForEachOccupiedRun(const Runs &runs, const TileOccupancy &occupancy, int y, Func f)
+    {
+        for(const pair<int,int> &span: occupancy.GetOccupiedSpans(y))
+            runs.for_each_run(y, span.first, span.second, f);
+    }
+
+    // Sum the color in each bucket.  The data is premultiplied, so this will weight
+    // by alpha, making transparent pixels contribute less to the color of the block
+    // than opaque ones.  Empty pixels add nothing, so empty tiles are skipped.
+    template<typename Runs, typename Pixel>
+    void SumRows(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int y_start, int y_end)
+    {
+        RowSummer summer(color_buckets);
+        for(int y = y_start; y < y_end; y++)
+        {
+            const Pixel *row = image.row(y);
+            ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                summer.add(row, x_start, x_end, offset);
+            });
+            summer.flush();
+        }
+    }
+
+    template<typename Runs, typename Pixel>
+    void SumBuckets(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        // Sum the even bands, then the odd bands.  See ColorBuckets::get_band_starts.
+        vector<int> band_starts = color_buckets.get_band_starts(image.height);
+        int bands = int(band_starts.size()) - 1;
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                int band = i*2 + phase;
+                SumRows(image, occupancy, color_buckets, runs, band_starts[band], band_starts[band+1]);
+            });
+        }
+    }
+
+    void NormalizeBuckets(ColorBuckets &color_buckets, int threads)
+    {
+        const int chunk_size = 64*1024;
+        int count = int(color_buckets.buckets.size());
+        ParallelFor((count + chunk_size - 1) / chunk_size, threads, [&](int chunk) {
+            // Except for completely transparent buckets, make all buckets completely opaque.
+            int start = chunk * chunk_size;
+            int end = min(count, (chunk+1) * chunk_size);
+            color_buckets.store_sums(start, end);
+            Vec4fKernels::Normalize(&color_buckets.buckets[start], end - start);
+        });
+    }
+
+    // Write the bucket colors back to the image.  Empty pixels stay empty, since their
+    // alpha is zero, so empty tiles are skipped.
+    template<typename Runs, typename Pixel>
+    void WriteBuckets(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, const ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        const int rows_per_chunk = 16;
+        ParallelFor((image.height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            int y_end = min(image.height, (chunk+1) * rows_per_chunk);
+            for(int y = chunk * rows_per_chunk; y < y_end; y++)
+            {
+                Pixel *row = image.row(y);
+                ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                    // Leave the alpha value in the destination alone, and multiply the color by
+                    // alpha if the pixels are premultiplied.
+                    WritePixelRun(row + x_start, x_end - x_start, color_buckets.get_bucket(offset));
+                });
+            }
+        });
+    }
+
+    // Allocate color_buckets with the given layout.  If the grid is large and the occupied
+    // tiles only reach a small part of it, use sparse storage unless row-major was asked for,
+    // so memory scales with the content of the image rather than its size.  This must be done
+    // before making runs, since it changes the offsets.
+    // Dense grids smaller than this aren't worth avoiding.
+    const size_t max_dense_buckets = 1024*1024;
+
+    void AllocateBuckets(ColorBuckets &color_buckets, const TileOccupancy &occupancy, int width, int height, Mosaic::BucketLayout layout, int threads)
+    {
+        size_t grid_size = size_t(color_buckets.grid_width) * color_buckets.grid_height;
+        if(layout != Mosaic::BucketLayout::RowMajor && grid_size > max_dense_buckets &&
+            color_buckets.allocate_sparse(occupancy, width, height, threads))
+            return;
+
+        // Tiles only helped some small rotated blocks, and made others slower, so they're
+        // only used when asked for.  The commandline's -l and -B options compare them.
+        if(layout == Mosaic::BucketLayout::Auto)
+            layout = Mosaic::BucketLayout::RowMajor;
+
+        color_buckets.allocate(layout, threads);
+    }
+
+    // Apply the mosaic.  color_buckets must already be allocated.
+    template<typename Runs, typename Pixel>
+    void ApplyMosaicWithRuns(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        SumBuckets(image, occupancy, color_buckets, runs, threads);
+        NormalizeBuckets(color_buckets, threads);
+        WriteBuckets(image, occupancy, color_buckets, runs, threads);
+    }
+
+    Mosaic::Rect IntersectRect(const Mosaic::Rect &lhs, const Mosaic::Rect &rhs)
+    {
+        Mosaic::Rect result;
+        result.x1 = max(lhs.x1, rhs.x1);
+        result.y1 = max(lhs.y1, rhs.y1);
+        result.x2 = min(lhs.x2, rhs.x2);
+        result.y2 = min(lhs.y2, rhs.y2);
+        return result;
+    }
+
+    // Return the pixels of a width x height image that are in blocks overlapping rect.
+    // See Mosaic::GetInputRect.
+    Mosaic::Rect GetBlockRect(const ColorBuckets &color_buckets, int width, int height, const Mosaic::Rect &rect)
+    {
+        Mosaic::Rect result = IntersectRect(rect, Mosaic::Rect { 0, 0, width, height });
+        if(result.IsEmpty())
+            return Mosaic::Rect();
+
+        if(!color_buckets.axis_aligned)
+        {
+            // A pixel in the same block as a pixel in rect is less than a block's width
+            // away from it.  Add a couple of pixels for rounding in the fixed-point mapping.
+            int margin = int(ceilf(color_buckets.block_size * (fabsf(color_buckets.cos_angle) + fabsf(color_buckets.sin_angle)))) + 2;
+            return IntersectRect(Mosaic::Rect { result.x1 - margin, result.y1 - margin, result.x2 + margin, result.y2 + margin },
+                Mosaic::Rect { 0, 0, width, height });
+        }
+
+        // Move each edge out to the edge of the blocks it's in.  This is the same mapping
+        // as AxisAlignedRuns.
+        auto column_bucket = [&](int x) {
+            pair<int,int> idx = color_buckets.get_bucket_index(x, color_buckets.origin_y);
+            return color_buckets.swap_axes? idx.second:idx.first;
+        };
+        auto row_bucket = [&](int y) {
+            pair<int,int> idx = color_buckets.get_bucket_index(color_buckets.origin_x, y);
+            return color_buckets.swap_axes? idx.first:idx.second;
+        };
+
+        int bucket = column_bucket(result.x1);
+        while(result.x1 > 0 && column_bucket(result.x1-1) == bucket)
+            result.x1--;
+        bucket = column_bucket(result.x2-1);
+        while(result.x2 < width && column_bucket(result.x2) == bucket)
+            result.x2++;
+        bucket = row_bucket(result.y1);
+        while(result.y1 > 0 && row_bucket(result.y1-1) == bucket)
+            result.y1--;
+        bucket = row_bucket(result.y2-1);
+        while(result.y2 < height && row_bucket(result.y2) == bucket)
+            result.y2++;
+        return result;
+    }
+
+    // Call f(x_start, x_end, offset) for each run on row y between x_begin and x_end,
+    // skipping empty tiles.
+    template<typename Runs, typename Func>
+    void ForEachOccupiedRunInRange(const Runs &runs, const TileOccupancy &occupancy, int y, int x_begin, int x_end, Func f)
+    {
+        for(const pair<int,int> &span: occupancy.GetOccupiedSpans(y))
+        {
+            int x_start = max(span.first, x_begin);
+            int x_stop = min(span.second, x_end);
+            if(x_start < x_stop)
+                runs.for_each_run(y, x_start, x_stop, f);
+        }
+    }
+
+    // Apply the mosaic to the pixels of image in output_rect, writing them to output at
+    // (output_x, output_y), and summing only the pixels in input_rect.  color_buckets'
+    // grid only needs to cover input_rect, and must already be allocated.  If output isn't
+    // image, each row of output_rect is copied to it just before its colors are written,
+    // while it's in cache.
+    template<typename Runs>
+    void ApplyMosaicToRectWithRuns(const ConstImageView &image, const Mosaic::Rect &input_rect, const Mosaic::Rect &output_rect,
+        const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs,
+        const ImageView &output, int output_x, int output_y, int threads)
+    {
+        // Sum the even bands, then the odd bands, using the same bands as the whole
+        // image.  See ColorBuckets::get_band_starts.
+        vector<int> band_starts = color_buckets.get_band_starts(image.height);
+        int bands = int(band_starts.size()) - 1;
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                int band = i*2 + phase;
+                RowSummer summer(color_buckets);
+                int y_end = min(band_starts[band+1], input_rect.y2);
+                for(int y = max(band_starts[band], input_rect.y1); y < y_end; y++)
+                {
+                    const Vec4f *row = image.row(y);
+                    ForEachOccupiedRunInRange(runs, occupancy, y, input_rect.x1, input_rect.x2, [&](int x_start, int x_end, int offset) {
+                        summer.add(row, x_start, x_end, offset);
+                    });
+                    summer.flush();
+                }
+            });
+        }
+
+        NormalizeBuckets(color_buckets, threads);
+
+        const int rows_per_chunk = 16;
+        int height = output_rect.y2 - output_rect.y1;
+        ParallelFor((height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            int y_end = min(output_rect.y2, output_rect.y1 + (chunk+1) * rows_per_chunk);
+            for(int y = output_rect.y1 + chunk * rows_per_chunk; y < y_end; y++)
+            {
+                Vec4f *row = output.row(y - output_y);
+                if(output.pixels != image.pixels)
+                {
+                    const Vec4f *input_row = image.row(y);
+                    copy(input_row + output_rect.x1, input_row + output_rect.x2, row + output_rect.x1 - output_x);
+                }
+
+                ForEachOccupiedRunInRange(runs, occupancy, y, output_rect.x1, output_rect.x2, [&](int x_start, int x_end, int offset) {
+                    Vec4fKernels::WriteRun(row + x_start - output_x, x_end - x_start, color_buckets.get_bucket(offset));
+                });
+            }
+        });
+    }
+
+    // Return a hash of a cell of the sample grid used by ApplyMosaicApproximate.
+    uint32_t HashSampleCell(int cell_x, int cell_y)
+    {
+        uint32_t h = uint32_t(cell_x) * 0x9E3779B1u ^ uint32_t(cell_y) * 0x85EBCA77u;
+        h ^= h >> 15;
+        h *= 0x2C1B3C6Du;
+        h ^= h >> 12;
+        h *= 0x297A2D39u;
+        h ^= h >> 15;
+        return h;
+    }
+
+    // The moments of a bucket's samples needed to estimate the error of its color, besides
+    // their sum: the sums of each channel squared, and of each color channel times alpha.
+    // The number of samples is in cross.w.
+    struct SampleMoments
+    {
+        Vec4f squares, cross;
+    };
+
+    // Apply an approximate mosaic of the pixels of image in output_rect, writing them to
+    // output at (output_x, output_y), and sampling one pixel from each step x step cell of
+    // input_rect.  output may be image.  Return the error estimate described by
+    // Mosaic::ApplyMosaicApproximate for the blocks in output_rect.  color_buckets' grid
+    // only needs to cover input_rect, and must already be allocated dense.
+    template<typename Runs>
+    float ApplyApproximateWithRuns(const Image &image, const Mosaic::Rect &input_rect, const Mosaic::Rect &output_rect,
+        ColorBuckets &color_buckets, const Runs &runs, int step, Image &output, int output_x, int output_y, int threads)
+    {
+        vector<SampleMoments> moments(color_buckets.buckets.size());
+        auto sum_row = [&](int y) {
+            // Each row of cells samples one row of pixels, and each cell on it samples one
+            // pixel.  Cells crossing a run boundary are checked by both runs.
+            const Vec4f *row = &image.rgba[y*image.width];
+            int cell_y = y / step;
+            runs.for_each_run(y, input_rect.x1, input_rect.x2, [&](int x_start, int x_end, int offset) {
+                SampleMoments &bucket_moments = moments[offset];
+                for(int cell_x = x_start / step; cell_x * step < x_end; ++cell_x)
+                {
+                    int x = cell_x*step + int(HashSampleCell(cell_x, cell_y) % step);
+                    if(x < x_start || x >= x_end)
+                        continue;
+
+                    const Vec4f &pixel = row[x];
+                    color_buckets.add_sum(offset, pixel);
+                    bucket_moments.squares += pixel * pixel;
+                    bucket_moments.cross += Vec4f(pixel.x * pixel.w, pixel.y * pixel.w, pixel.z * pixel.w, 1);
+                }
+            });
+        };
+
+        // Call sum_band(y1, y2) for the rows of input_rect in the even bands, then the odd
+        // bands, using the same bands as the whole image.  See ColorBuckets::get_band_starts.
+        vector<int> band_starts = color_buckets.get_band_starts(image.height);
+        int bands = int(band_starts.size()) - 1;
+        auto for_each_band = [&](const function<void(int y1, int y2)> &sum_band) {
+            for(int phase = 0; phase < 2; ++phase)
+            {
+                ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                    int band = i*2 + phase;
+                    int y1 = max(band_starts[band], input_rect.y1);
+                    int y2 = min(band_starts[band+1], input_rect.y2);
+                    if(y1 < y2)
+                        sum_band(y1, y2);
+                });
+            }
+        };
+
+        for_each_band([&](int y1, int y2) {
+            for(int cell_y = y1 / step; cell_y * step < y2; ++cell_y)
+            {
+                int y = cell_y*step + int(HashSampleCell(-1, cell_y) % step);
+                if(y >= y1 && y < y2)
+                    sum_row(y);
+            }
+        });
+
+        // Blocks that are only slivers, at the edge of the image or where a rotated grid
+        // cuts a corner, can fall between the samples entirely.  Sum those exactly, so they
+        // aren't left empty.  Their sample count stays 0, which marks them as exact below.
+        for_each_band([&](int y1, int y2) {
+            for(int y = y1; y < y2; ++y)
+            {
+                const Vec4f *row = &image.rgba[y*image.width];
+                runs.for_each_run(y, input_rect.x1, input_rect.x2, [&](int x_start, int x_end, int offset) {
+                    if(moments[offset].cross.w != 0)
+                        return;
+
+                    for(int x = x_start; x < x_end; ++x)
+                        color_buckets.add_sum(offset, row[x]);
+                });
+            }
+        });
+
+        // Each sample stands for a cell of step*step pixels, so scale the sums up to match
+        // the exact sums before normalizing, so Normalize's alpha threshold means the same
+        // thing.  Estimate each bucket's error along the way.  The color is a ratio of sums,
+        // and its variance is estimated from the residuals d = color - ratio*alpha, whose
+        // sum of squares is expanded into the moments.  Blocks that were summed exactly
+        // have no error.
+        const int chunk_size = 64*1024;
+        int count = int(color_buckets.buckets.size());
+        vector<float> errors(count, 0.0f);
+        float scale = float(step * step);
+        ParallelFor((count + chunk_size - 1) / chunk_size, threads, [&](int chunk) {
+            int start = chunk * chunk_size;
+            int end = min(count, (chunk+1) * chunk_size);
+            color_buckets.store_sums(start, end);
+            for(int i = start; i < end; ++i)
+            {
+                Vec4f &sum = color_buckets.buckets[i];
+                const SampleMoments &bucket_moments = moments[i];
+                double samples = bucket_moments.cross.w;
+                if(samples == 0)
+                    continue;
+
+                sum = sum * scale;
+                if(sum.w <= 0.01f)
+                    continue;
+
+                double error = 0;
+                for(int c = 0; c < 3; ++c)
+                {
+                    double ratio = double(sum[c]) / sum.w;
+                    if(samples < 2)
+                    {
+                        error = max(error, fabs(ratio));
+                        continue;
+                    }
+
+                    double residuals = bucket_moments.squares[c] - 2*ratio*bucket_moments.cross[c] + ratio*ratio*bucket_moments.squares.w;
+                    double variance = max(residuals, 0.0) * samples / (samples - 1) * (1 - 1/scale);
+                    error = max(error, 3 * sqrt(variance) * scale / sum.w);
+                }
+                errors[i] = float(error);
+            }
+
+            Vec4fKernels::Normalize(&color_buckets.buckets[start], end - start);
+        });
+
+        // Write every pixel of output_rect, and find the largest error of the blocks
+        // written.  Tiles weren't scanned, but writing to empty pixels leaves them empty.
+        // If we're not working in place, copy each row to the output first.
+        const int rows_per_chunk = 16;
+        int height = output_rect.y2 - output_rect.y1;
+        int chunks = (height + rows_per_chunk - 1) / rows_per_chunk;
+        vector<float> chunk_errors(chunks, 0.0f);
+        ParallelFor(chunks, threads, [&](int chunk) {
+            int y_end = min(output_rect.y2, output_rect.y1 + (chunk+1) * rows_per_chunk);
+            for(int y = output_rect.y1 + chunk * rows_per_chunk; y < y_end; y++)
+            {
+                Vec4f *row = &output.rgba[(y - output_y)*output.width] - output_x;
+                if(&output != &image)
+                {
+                    const Vec4f *input_row = &image.rgba[y*image.width];
+                    copy(input_row + output_rect.x1, input_row + output_rect.x2, row + output_rect.x1);
+                }
+
+                runs.for_each_run(y, output_rect.x1, output_rect.x2, [&](int x_start, int x_end, int offset) {
+                    Vec4fKernels::WriteRun(row + x_start, x_end - x_start, color_buckets.buckets[offset]);
+                    chunk_errors[chunk] = max(chunk_errors[chunk], errors[offset]);
+                });
+            }
+        });
+
+        return chunks > 0? *max_element(chunk_errors.begin(), chunk_errors.end()):0.0f;
+    }
+
+    // Copy the pixels of image in rect to output at (output_x, output_y).
+    void CopyRect(const ConstImageView &image, const Mosaic::Rect &rect, const ImageView &output, int output_x, int output_y, int threads)
+    {
+        const int rows_per_chunk = 16;
+        int height = rect.y2 - rect.y1;
+        ParallelFor((height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            int y_end = min(rect.y2, rect.y1 + (chunk+1) * rows_per_chunk);
+            for(int y = rect.y1 + chunk * rows_per_chunk; y < y_end; y++)
+            {
+                const Vec4f *row = image.row(y);
+                copy(row + rect.x1, row + rect.x2, output.row(y - output_y) + rect.x1 - output_x);
+            }
+        });
+    }
+
+    // Return the offset in coarse of the bucket containing bucket fine_offset of fine, where
+    // coarse has the same angle and origin as fine, and its blocks are exactly factor by factor
+    // fine blocks.  The coarse bucket is found by dividing the fine bucket index, so pixels are
+    // assigned to coarse blocks consistently with the fine grid.
+    int GetNestedBucketOffset(const ColorBuckets &fine, const ColorBuckets &coarse, int factor, int fine_offset)
+    {
+        int bucket_x = fine.grid_x + fine_offset % fine.grid_width;
+        int bucket_y = fine.grid_y + fine_offset / fine.grid_width;
+        return coarse.get_bucket_offset(
+            int(FixedPointAxis::floor_div(bucket_x, factor)),
+            int(FixedPointAxis::floor_div(bucket_y, factor)));
+    }
+
+    // One block size in ApplyMosaicPyramid.
+    struct PyramidLevel
+    {
+        float block_size = 1;
+
+        // The level this one is combined from, or -1 if it's summed from the image, and the
+        // number of parent blocks across each of our blocks.
+        int parent = -1;
+        int factor = 1;
+
+        // The level summed from the image that this one nests in, and the number of its blocks
+        // across each of ours.  For levels summed from the image, this is the level itself.
+        int root = -1;
+        int root_factor = 1;
+
+        unique_ptr<ColorBuckets> color_buckets;
+
+        // The offset of our bucket for each bucket in the root level.
+        vector<int> offsets_from_root;
+    };
+
+    // Sort block sizes into levels, nesting each one in the largest smaller level it's a
+    // whole multiple of.  Return the level for each block size.
+    vector<int> GetPyramidLevels(const vector<float> &block_sizes, vector<PyramidLevel> &levels)
+    {
+        vector<int> order(block_sizes.size());
+        for(int i = 0; i < int(order.size()); ++i)
+            order[i] = i;
+        stable_sort(order.begin(), order.end(), [&](int lhs, int rhs) { return block_sizes[lhs] < block_sizes[rhs]; });
+
+        vector<int> result_levels(block_sizes.size());
+        for(int i: order)
+        {
+            float block_size = max(1.0f, block_sizes[i]);
+
+            // Find the largest level this block size is a multiple of.  If it's the same size,
+            // share the level.
+            PyramidLevel level;
+            level.block_size = block_size;
+            int existing = -1;
+            for(int j = int(levels.size()) - 1; j >= 0; --j)
+            {
+                float ratio = block_size / levels[j].block_size;
+                long factor = lroundf(ratio);
+                if(fabsf(ratio - factor) > ratio * 1e-5f)
+                    continue;
+
+                if(factor == 1)
+                    existing = j;
+                else
+                {
+                    level.parent = j;
+                    level.factor = int(factor);
+                    level.root = levels[j].root;
+                    level.root_factor = levels[j].root_factor * level.factor;
+                }
+                break;
+            }
+
+            if(existing != -1)
+            {
+                result_levels[i] = existing;
+                continue;
+            }
+
+            if(level.parent == -1)
+                level.root = int(levels.size());
+
+            result_levels[i] = int(levels.size());
+            levels.push_back(move(level));
+        }
+        return result_levels;
+    }
+
+    template<typename Runs, typename MakeRuns>
+    void ApplyPyramidWithRuns(const Image &image, const TileOccupancy &occupancy, vector<PyramidLevel> &levels,
+        const vector<int> &result_levels, vector<Image> &results, MakeRuns make_runs, int threads)
+    {
+        // Make runs for each level we sum from the image.
+        vector<unique_ptr<Runs>> root_runs(levels.size());
+        int largest_root = -1;
+        for(int i = 0; i < int(levels.size()); ++i)
+        {
+            levels[i].color_buckets->allocate(Mosaic::BucketLayout::RowMajor, threads);
+            if(levels[i].root == i)
+            {
+                root_runs[i].reset(new Runs(make_runs(*levels[i].color_buckets)));
+                largest_root = i;
+            }
+        }
+
+        // Sum every root level in one pass over the image.  Bands for the largest block size
+        // are at least as tall as any smaller block, so they work for every level.  See
+        // ColorBuckets::get_band_starts.
+        vector<int> band_starts = levels[largest_root].color_buckets->get_band_starts(image.height);
+        int bands = int(band_starts.size()) - 1;
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                int band = i*2 + phase;
+                for(int level = 0; level < int(levels.size()); ++level)
+                {
+                    if(root_runs[level])
+                        SumRows(ConstImageView(image), occupancy, *levels[level].color_buckets, *root_runs[level], band_starts[band], band_starts[band+1]);
+                }
+            });
+        }
+
+        // Combine each nested level from its parent.  Levels are sorted by size, so parents
+        // are always complete first.
+        for(PyramidLevel &level: levels)
+        {
+            if(level.parent == -1)
+                continue;
+
+            // Levels are dense, so offsets are indices.  Blocks only get bigger, so if the
+            // parent sums in doubles, so do we.
+            const ColorBuckets &parent = *levels[level.parent].color_buckets;
+            ColorBuckets &child = *level.color_buckets;
+            for(int i = 0; i < int(parent.buckets.size()); ++i)
+            {
+                int offset = GetNestedBucketOffset(parent, child, level.factor, i);
+                if(parent.sums.empty())
+                    child.add_sum(offset, parent.buckets[i]);
+                else
+                    child.sums[offset].add(parent.sums[i]);
+            }
+        }
+
+        // Normalize, and map each root bucket to each level's bucket for writing.
+        ParallelFor(int(levels.size()), threads, [&](int i) {
+            PyramidLevel &level = levels[i];
+            const ColorBuckets &root = *levels[level.root].color_buckets;
+            level.offsets_from_root.resize(root.buckets.size());
+            for(int j = 0; j < int(root.buckets.size()); ++j)
+                level.offsets_from_root[j] = GetNestedBucketOffset(root, *level.color_buckets, level.root_factor, j);
+
+            NormalizeBuckets(*level.color_buckets, 1);
+        });
+
+        for(int i = 0; i < int(results.size()); ++i)
+        {
+            results[i].width = image.width;
+            results[i].height = image.height;
+            ResizeUninitialized(results[i].rgba, image.rgba.size());
+        }
+
+        // Write every result.  Each row of the source is read once, and its root runs are only
+        // found once, then written to each result while they're still in cache.
+        struct Run
+        {
+            int x_start, x_end, offset;
+        };
+
+        const int rows_per_chunk = 16;
+        ParallelFor((image.height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            vector<vector<Run>> row_runs(levels.size());
+            int y_end = min(image.height, (chunk+1) * rows_per_chunk);
+            for(int y = chunk * rows_per_chunk; y < y_end; y++)
+            {
+                for(int level = 0; level < int(levels.size()); ++level)
+                {
+                    if(!root_runs[level])
+                        continue;
+
+                    row_runs[level].clear();
+                    ForEachOccupiedRun(*root_runs[level], occupancy, y, [&](int x_start, int x_end, int offset) {
+                        row_runs[level].push_back({ x_start, x_end, offset });
+                    });
+                }
+
+                const Vec4f *source_row = image.rgba.data() + y*image.width;
+                for(int i = 0; i < int(results.size()); ++i)
+                {
+                    const PyramidLevel &level = levels[result_levels[i]];
+                    const BufferVector<Vec4f> &buckets = level.color_buckets->buckets;
+                    Vec4f *row = results[i].rgba.data() + y*image.width;
+                    copy(source_row, source_row + image.width, row);
+
+                    // Neighboring root runs often go to the same bucket, so join them.
+                    int run_start = 0, run_end = 0, run_offset = -1;
+                    for(const Run &run: row_runs[level.root])
+                    {
+                        int offset = level.offsets_from_root[run.offset];
+                        if(offset != run_offset || run.x_start != run_end)
+                        {
+                            Vec4fKernels::WriteRun(row + run_start, run_end - run_start, buckets[max(run_offset, 0)]);
+                            run_start = run.x_start;
+                            run_offset = offset;
+                        }
+                        run_end = run.x_end;
+                    }
+                    Vec4fKernels::WriteRun(row + run_start, run_end - run_start, buckets[max(run_offset, 0)]);
+                }
+            }
+        });
+    }
+
+    // Store the runs from a run source in plan.
+    template<typename Runs>
+    void BuildPlan(Mosaic::Plan &plan, int width, int height, const Runs &runs)
+    {
+        plan.runs.clear();
+        plan.row_starts.resize(height+1);
+        for(int y = 0; y < height; y++)
+        {
+            plan.row_starts[y] = int(plan.runs.size());
+            runs.for_each_run(y, 0, width, [&](int, int x_end, int offset) {
+                plan.runs.push_back({ x_end, offset });
+            });
+        }
+        plan.row_starts[height] = int(plan.runs.size());
+    }
+
+    // Render the mosaic of the pixels of input in rect to output, with output's top-left
+    // pixel at (output_x, output_y) in input.  input is the part of a larger image with its
+    // top-left corner at (input_x, input_y), and rect must be inside input.  If output
+    // is input, render in place.
+    void RenderRect(const ConstImageView &input, int input_x, int input_y, const Mosaic::Options &options,
+        const Mosaic::Rect &rect, const ImageView &output, int output_x, int output_y, RenderBuffers &buffers)
+    {
+        if(rect.IsEmpty())
+            return;
+
+        // Work in the coordinates of input.  ColorBuckets maps pixels the same way it would
+        // for the whole image.
+        ColorBuckets color_buckets(input.width, input.height, options.block_size, options.angle, options.origin_x, options.origin_y, input_x, input_y);
+        BorrowedStorage borrowed(color_buckets, buffers);
+
+        // Only the pixels in blocks overlapping rect affect it, so only scan and sum those,
+        // and size the grid to hold just their buckets.
+        Mosaic::Rect input_rect = GetBlockRect(color_buckets, input.width, input.height, rect);
+        color_buckets.fit_grid(input_rect.x1, input_rect.y1, input_rect.x2, input_rect.y2);
+
+        int threads = GetThreadCount(options);
+        TileOccupancy &occupancy = buffers.occupancy;
+        occupancy.Init(input.width, input.height);
+        int first_tile_row = input_rect.y1 / TileOccupancy::TileSize;
+        int end_tile_row = (input_rect.y2 + TileOccupancy::TileSize - 1) / TileOccupancy::TileSize;
+        ParallelFor(end_tile_row - first_tile_row, threads, [&](int i) {
+            occupancy.ScanTileRow(input, first_tile_row + i, input_rect.x1, input_rect.x2);
+        });
+
+        // If everything is empty, the mosaic doesn't change anything.
+        if(!occupancy.IsAnyOccupied())
+        {
+            if(output.pixels != input.pixels)
+                CopyRect(input, rect, output, output_x, output_y, threads);
+            return;
+        }
+
+        AllocateBuckets(color_buckets, occupancy, input.width, input.height, options.bucket_layout, threads);
+        if(color_buckets.axis_aligned)
+            ApplyMosaicToRectWithRuns(input, input_rect, rect, occupancy, color_buckets, AxisAlignedRuns(color_buckets, input.width, input.height), output, output_x, output_y, threads);
+        else
+            ApplyMosaicToRectWithRuns(input, input_rect, rect, occupancy, color_buckets, RotatedRuns(color_buckets, input.width), output, output_x, output_y, threads);
+    }
+
+    void ApplyInPlace(const ImageView &image, const Mosaic::Options &options, RenderBuffers &buffers)
+    {
+        int threads = GetThreadCount(options);
+
+        // Empty pixels stay empty, so only the blocks overlapping the content need to be
+        // rendered.  If the image is completely empty, the mosaic won't change it.
+        Mosaic::Rect bounds;
+        if(!GetContentBounds(image, bounds.x1, bounds.y1, bounds.x2, bounds.y2, threads))
+            return;
+
+        bool whole_image = bounds.x1 == 0 && bounds.y1 == 0 && bounds.x2 == image.width && bounds.y2 == image.height;
+        if(!whole_image && options.traversal != Mosaic::Traversal::BlockMajor)
+        {
+            RenderRect(image, 0, 0, options, bounds, image, 0, 0, buffers);
+            return;
+        }
+
+        // Break the image up into buckets, and sum the color in each bucket.  RenderRect
+        // borrows buffers itself, so this can't borrow them until it's known not to be used.
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        BorrowedStorage borrowed(color_buckets, buffers);
+
+        TileOccupancy &occupancy = buffers.occupancy;
+        ScanOccupancy(image, occupancy, threads);
+
+        if(color_buckets.axis_aligned)
+        {
+            AllocateBuckets(color_buckets, occupancy, image.width, image.height, options.bucket_layout, threads);
+            ApplyMosaicWithRuns(image, occupancy, color_buckets, AxisAlignedRuns(color_buckets, image.width, image.height), threads);
+            return;
+        }
+
+        // Block-major traversal has some overhead for each row of each block, and in practice
+        // it only beats the raster traversal by a small margin with large blocks, so it
+        // isn't used unless it's asked for.
+        Mosaic::Traversal traversal = options.traversal;
+        if(traversal == Mosaic::Traversal::Auto)
+            traversal = Mosaic::Traversal::Raster;
+
+        if(traversal == Mosaic::Traversal::BlockMajor)
+        {
+            ParallelFor(color_buckets.grid_height, threads, [&](int row) {
+                BlockMajorRotated(color_buckets).apply_row(image, occupancy, color_buckets.grid_y + row);
+            });
+        }
+        else
+        {
+            AllocateBuckets(color_buckets, occupancy, image.width, image.height, options.bucket_layout, threads);
+            ApplyMosaicWithRuns(image, occupancy, color_buckets, RotatedRuns(color_buckets, image.width), threads);
+        }
+    }
+
+    void ApplyWithPlan(const ImageView &image, const Mosaic::Options &options, Mosaic::Plan &plan, RenderBuffers &buffers)
+    {
+        int threads = GetThreadCount(options);
+
+        Mosaic::Rect bounds;
+        if(!GetContentBounds(image, bounds.x1, bounds.y1, bounds.x2, bounds.y2, threads))
+            return;
+
+        // The plan covers the whole image.  If the content only covers a small part of it,
+        // rendering just that part is cheaper than using the plan.
+        int64_t content_area = int64_t(bounds.x2 - bounds.x1) * (bounds.y2 - bounds.y1);
+        if(content_area * 2 < int64_t(image.width) * image.height)
+        {
+            RenderRect(image, 0, 0, options, bounds, image, 0, 0, buffers);
+            return;
+        }
+
+        // As in ApplyInPlace, don't borrow buffers until RenderRect won't.
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        BorrowedStorage borrowed(color_buckets, buffers);
+
+        TileOccupancy &occupancy = buffers.occupancy;
+        ScanOccupancy(image, occupancy, threads);
+
+        if(!plan.Matches(image.width, image.height, options))
+        {
+            if(color_buckets.axis_aligned)
+                BuildPlan(plan, image.width, image.height, AxisAlignedRuns(color_buckets, image.width, image.height));
+            else
+                BuildPlan(plan, image.width, image.height, RotatedRuns(color_buckets, image.width));
+
+            plan.valid = true;
+            plan.width = image.width;
+            plan.height = image.height;
+            plan.options = options;
+        }
+
+        // Plans store dense offsets, so always use dense storage.
+        color_buckets.allocate(Mosaic::BucketLayout::RowMajor, threads);
+        ApplyMosaicWithRuns(image, occupancy, color_buckets, PlanRuns(plan), threads);
+    }
+
+    // Sum 8-bit pixels into integer buckets.  Integer sums are exact, so unlike RowSummer,
+    // the order pixels are added in doesn't matter.
+    template<typename Runs, typename Pixel>
+    void SumIntegerRows(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int y_start, int y_end)
+    {
+        for(int y = y_start; y < y_end; y++)
+        {
+            const Pixel *row = image.row(y);
+            ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                uint32_t r = 0, g = 0, b = 0, a = 0;
+                for(int x = x_start; x < x_end; ++x)
+                {
+                    const Pixel &p = row[x];
+                    r += uint32_t(p.r) * p.a;
+                    g += uint32_t(p.g) * p.a;
+                    b += uint32_t(p.b) * p.a;
+                    a += p.a;
+                }
+
+                IntBucketSum sum;
+                sum.r = r;
+                sum.g = g;
+                sum.b = b;
+                sum.a = a;
+                color_buckets.add_sum(offset, sum);
+            });
+        }
+    }
+
+    template<typename Runs, typename Pixel>
+    void SumIntegerBuckets(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        // Sum the even bands, then the odd bands.  See ColorBuckets::get_band_starts.
+        vector<int> band_starts = color_buckets.get_band_starts(image.height);
+        int bands = int(band_starts.size()) - 1;
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                int band = i*2 + phase;
+                SumIntegerRows(image, occupancy, color_buckets, runs, band_starts[band], band_starts[band+1]);
+            });
+        }
+    }
+
+    // Replace each integer sum with the bucket's 8-bit color.  This is NormalizeBuckets
+    // followed by converting to 8 bits: the float color is r/255/255 / (a/255), which is
+    // r/a out of 255, so we round r/a.  Like Vec4fKernels::Normalize, buckets with alpha at
+    // or below 0.01 are zero, which is an alpha sum of 2 or less.
+    void NormalizeIntegerBuckets(ColorBuckets &color_buckets, int threads)
+    {
+        const int chunk_size = 64*1024;
+        int count = int(color_buckets.int_sums.size());
+        ParallelFor((count + chunk_size - 1) / chunk_size, threads, [&](int chunk) {
+            int end = min(count, (chunk+1) * chunk_size);
+            for(int i = chunk * chunk_size; i < end; ++i)
+            {
+                IntBucketSum &sum = color_buckets.int_sums[i];
+                if(sum.a <= 2)
+                {
+                    sum = IntBucketSum();
+                    continue;
+                }
+
+                uint64_t half = sum.a / 2;
+                sum.r = uint32_t((sum.r + half) / sum.a);
+                sum.g = uint32_t((sum.g + half) / sum.a);
+                sum.b = uint32_t((sum.b + half) / sum.a);
+            }
+        });
+    }
+
+    // WriteBuckets for normalized integer buckets.
+    template<typename Runs, typename Pixel>
+    void WriteIntegerBuckets(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, const ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        const int rows_per_chunk = 16;
+        ParallelFor((image.height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            int y_end = min(image.height, (chunk+1) * rows_per_chunk);
+            for(int y = chunk * rows_per_chunk; y < y_end; y++)
+            {
+                Pixel *row = image.row(y);
+                ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                    // Transparent pixels are black, as in PixelTraits::Writer.
+                    const IntBucketSum &color = color_buckets.get_int_sum(offset);
+                    uint8_t r = uint8_t(color.r), g = uint8_t(color.g), b = uint8_t(color.b);
+                    for(int x = x_start; x < x_end; ++x)
+                    {
+                        uint8_t mask = row[x].a? 0xFF:0;
+                        row[x].r = r & mask;
+                        row[x].g = g & mask;
+                        row[x].b = b & mask;
+                    }
+                });
+            }
+        });
+    }
+
+    // Blocks up to this size can't overflow IntBucketSum, even when rotated.
+    const float max_integer_block_size = 128;
+
+    // Return true if pixels can be summed in integers.  Only 8-bit pixels are, since wider
+    // pixels would overflow 32-bit sums too quickly.
+    template<typename Pixel>
+    bool CanSumIntegers(const BasicImageView<Pixel> &, const Mosaic::Options &)
+    {
+        return false;
+    }
+
+    inline bool CanSumIntegers(const BasicImageView<Rgba8> &, const Mosaic::Options &options)
+    {
+        return options.block_size <= max_integer_block_size;
+    }
+
+    inline bool CanSumIntegers(const BasicImageView<Argb8> &, const Mosaic::Options &options)
+    {
+        return options.block_size <= max_integer_block_size;
+    }
+
+    // Apply the mosaic to 8-bit pixels, in integers if CanSumIntegers allowed it.
+    template<typename Runs, typename Pixel>
+    void ApplyIntegerPixelsWithRuns(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        if(!color_buckets.integer_sums)
+        {
+            ApplyMosaicWithRuns(image, occupancy, color_buckets, runs, threads);
+            return;
+        }
+
+        SumIntegerBuckets(image, occupancy, color_buckets, runs, threads);
+        NormalizeIntegerBuckets(color_buckets, threads);
+        WriteIntegerBuckets(image, occupancy, color_buckets, runs, threads);
+    }
+
+    // Apply the mosaic to compact pixels.  color_buckets must already be allocated.
+    template<typename Runs, typename Pixel>
+    void ApplyPixelsWithRuns(const BasicImageView<Pixel> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        ApplyMosaicWithRuns(image, occupancy, color_buckets, runs, threads);
+    }
+
+    template<typename Runs>
+    void ApplyPixelsWithRuns(const BasicImageView<Rgba8> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        ApplyIntegerPixelsWithRuns(image, occupancy, color_buckets, runs, threads);
+    }
+
+    template<typename Runs>
+    void ApplyPixelsWithRuns(const BasicImageView<Argb8> &image, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        ApplyIntegerPixelsWithRuns(image, occupancy, color_buckets, runs, threads);
+    }
+
+    // Find which tiles of an image of compact pixels have any pixels in them.  Empty tiles
+    // aren't written, so clear the empty pixels the scan passes with ClearEmpty, so they
+    // come out as they would from the float path.  Every pixel of an empty tile is passed,
+    // and pixels in occupied tiles are handled when they're written.
+    template<typename Pixel>
+    void ScanPixelOccupancy(const BasicImageView<Pixel> &image, TileOccupancy &occupancy, int threads)
+    {
+        occupancy.Init(image.width, image.height);
+        ParallelFor(occupancy.tiles_y, threads, [&](int tile_y) {
+            occupancy.ScanTileRow(tile_y, [&](int x1, int y1, int x2, int y2) {
+                for(int y = y1; y < y2; ++y)
+                {
+                    Pixel *row = image.row(y);
+                    for(int x = x1; x < x2; ++x)
+                    {
+                        if(!PixelTraits<Pixel>::IsEmpty(row[x]))
+                            return false;
+                        PixelTraits<Pixel>::ClearEmpty(row[x]);
+                    }
+                }
+                return true;
+            });
+        });
+    }
+
+    // Apply the mosaic to an image of compact pixels in place.  Pixels are converted as
+    // they're read and written, and summed in float or double like Vec4f pixels, so this
+    // gives the same sums as the raster traversal of the image converted to Vec4f.  8-bit
+    // pixels with blocks that fit are summed in integers instead.
+    template<typename Pixel>
+    void ApplyPixels(const BasicImageView<Pixel> &image, const Mosaic::Options &options, RenderBuffers &buffers)
+    {
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        color_buckets.integer_sums = CanSumIntegers(image, options);
+        BorrowedStorage borrowed(color_buckets, buffers);
+        int threads = GetThreadCount(options);
+
+        TileOccupancy &occupancy = buffers.occupancy;
+        ScanPixelOccupancy(image, occupancy, threads);
+        if(!occupancy.IsAnyOccupied())
+            return;
+
+        AllocateBuckets(color_buckets, occupancy, image.width, image.height, options.bucket_layout, threads);
+        if(color_buckets.axis_aligned)
+            ApplyPixelsWithRuns(image, occupancy, color_buckets, AxisAlignedRuns(color_buckets, image.width, image.height), threads);
+        else
+            ApplyPixelsWithRuns(image, occupancy, color_buckets, RotatedRuns(color_buckets, image.width), threads);
+    }
+
+    // SumBuckets for every layer at once.  Each row of every layer is read while the runs
+    // of the row are being walked, so the mapping is only done once.
+    template<typename Runs>
+    void SumLayerBuckets(const vector<ConstImageView> &layers, const TileOccupancy &occupancy, ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        vector<int> band_starts = color_buckets.get_band_starts(layers[0].height);
+        int bands = int(band_starts.size()) - 1;
+        for(int phase = 0; phase < 2; ++phase)
+        {
+            ParallelFor((bands - phase + 1) / 2, threads, [&](int i) {
+                int band = i*2 + phase;
+                LayerRowSummer summer(color_buckets);
+                vector<const Vec4f *> rows(layers.size());
+                for(int y = band_starts[band]; y < band_starts[band+1]; y++)
+                {
+                    for(size_t layer = 0; layer < layers.size(); ++layer)
+                        rows[layer] = layers[layer].row(y);
+
+                    ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                        summer.add(rows.data(), x_start, x_end, offset);
+                    });
+                    summer.flush();
+                }
+            });
+        }
+    }
+
+    // Divide every layer of each bucket by the alpha of its first layer.  This is the same
+    // as Vec4fKernels::Normalize, using the first layer's alpha for all of them.
+    void NormalizeLayerBuckets(ColorBuckets &color_buckets, int threads)
+    {
+        const int chunk_size = 16*1024;
+        int layers = color_buckets.layers;
+        int count = int(color_buckets.buckets.size() / layers);
+        ParallelFor((count + chunk_size - 1) / chunk_size, threads, [&](int chunk) {
+            int start = chunk * chunk_size;
+            int end = min(count, (chunk+1) * chunk_size);
+            color_buckets.store_sums(size_t(start) * layers, size_t(end) * layers);
+            for(int i = start; i < end; ++i)
+            {
+                Vec4f *bucket = &color_buckets.buckets[size_t(i) * layers];
+                float alpha = bucket[0].w;
+                for(int layer = 0; layer < layers; ++layer)
+                    bucket[layer] = alpha <= 0.01f? Vec4f(0,0,0,0):bucket[layer] * (1.0f/alpha);
+            }
+        });
+    }
+
+    // Write the bucket colors back to every layer.  The first layer keeps its alpha, like
+    // WriteBuckets.  All four channels of the other layers are premultiplied by that alpha,
+    // so they're all written.
+    template<typename Runs>
+    void WriteLayerBuckets(const vector<ImageView> &layers, const TileOccupancy &occupancy, const ColorBuckets &color_buckets, const Runs &runs, int threads)
+    {
+        const int rows_per_chunk = 16;
+        int height = layers[0].height;
+        ParallelFor((height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+            int y_end = min(height, (chunk+1) * rows_per_chunk);
+            for(int y = chunk * rows_per_chunk; y < y_end; y++)
+            {
+                Vec4f *alpha_row = layers[0].row(y);
+                ForEachOccupiedRun(runs, occupancy, y, [&](int x_start, int x_end, int offset) {
+                    const Vec4f *bucket = &color_buckets.buckets[color_buckets.get_index(offset)];
+                    for(size_t layer = 1; layer < layers.size(); ++layer)
+                    {
+                        Vec4f *row = layers[layer].row(y);
+                        for(int x = x_start; x < x_end; ++x)
+                            row[x] = bucket[layer] * alpha_row[x].w;
+                    }
+
+                    Vec4fKernels::WriteRun(alpha_row + x_start, x_end - x_start, bucket[0]);
+                });
+            }
+        });
+    }
+
+    // Apply the mosaic to layers in place, with the alpha of the first layer used for all
+    // of them.  Only the raster traversal is used.
+    void ApplyLayers(const vector<ImageView> &layers, const Mosaic::Options &options, RenderBuffers &buffers)
+    {
+        if(layers.empty())
+            return;
+
+        // Sanity check:
+        const ImageView &image = layers[0];
+        for(const ImageView &layer: layers)
+        {
+            if(layer.width != image.width || layer.height != image.height)
+                return;
+        }
+
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        color_buckets.layers = int(layers.size());
+        BorrowedStorage borrowed(color_buckets, buffers);
+        int threads = GetThreadCount(options);
+
+        // A tile can only be skipped if it's empty in every layer.
+        vector<ConstImageView> inputs(layers.begin(), layers.end());
+        TileOccupancy &occupancy = buffers.occupancy;
+        occupancy.Init(image.width, image.height);
+        ParallelFor(occupancy.tiles_y, threads, [&](int tile_y) {
+            occupancy.ScanTileRow(inputs, tile_y);
+        });
+
+        if(!occupancy.IsAnyOccupied())
+            return;
+
+        AllocateBuckets(color_buckets, occupancy, image.width, image.height, options.bucket_layout, threads);
+        if(color_buckets.axis_aligned)
+        {
+            AxisAlignedRuns runs(color_buckets, image.width, image.height);
+            SumLayerBuckets(inputs, occupancy, color_buckets, runs, threads);
+            NormalizeLayerBuckets(color_buckets, threads);
+            WriteLayerBuckets(layers, occupancy, color_buckets, runs, threads);
+        }
+        else
+        {
+            RotatedRuns runs(color_buckets, image.width);
+            SumLayerBuckets(inputs, occupancy, color_buckets, runs, threads);
+            NormalizeLayerBuckets(color_buckets, threads);
+            WriteLayerBuckets(layers, occupancy, color_buckets, runs, threads);
+        }
+    }
+}
+
+void Mosaic::SummedAreaTable::Build(shared_ptr<const Image> image)
+{
+    Build(image, Rect { 0, 0, image->width, image->height });
+}
+
+void Mosaic::SummedAreaTable::Build(shared_ptr<const Image> image, const Rect &rect_)
+{
+    source = image;
+    rect = IntersectRect(rect_, Rect { 0, 0, image->width, image->height });
+    int width = max(rect.x2 - rect.x1, 0), height = max(rect.y2 - rect.y1, 0);
+    int stride = (width+1) * 4;
+    table.assign(size_t(stride) * (height+1), 0.0);
+    ThreadPool &pool = ThreadPool::Get();
+
+    // Sum along each row.
+    pool.ParallelFor(height, 0, [&](int y) {
+        const Vec4f *row = &image->ptr(rect.x1, rect.y1 + y);
+        double *out = &table[size_t(y+1)*stride];
+        for(int x = 0; x < width; ++x)
+        {
+            for(int c = 0; c < 4; ++c)
+                out[(x+1)*4 + c] = out[x*4 + c] + row[x][c];
+        }
+    });
+
+    // Sum down each column.  Split the columns into chunks, so each thread still reads
+    // along rows.
+    const int chunk_size = 256;
+    pool.ParallelFor((stride + chunk_size - 1) / chunk_size, 0, [&](int chunk) {
+        int start = chunk * chunk_size;
+        int end = min(stride, start + chunk_size);
+        for(int y = 1; y < height; ++y)
+        {
+            const double *above = &table[size_t(y)*stride];
+            double *out = &table[size_t(y+1)*stride];
+            for(int i = start; i < end; ++i)
+                out[i] += above[i];
+        }
+    });
+}
+
+void Mosaic::SummedAreaTable::Release()
+{
+    source.reset();
+    rect = Rect();
+    vector<double>().swap(table);
+}
+
+Vec4f Mosaic::SummedAreaTable::get_sum(int x1, int y1, int x2, int y2) const
+{
+    x1 -= rect.x1; x2 -= rect.x1;
+    y1 -= rect.y1; y2 -= rect.y1;
+
+    size_t stride = size_t(rect.x2 - rect.x1 + 1) * 4;
+    const double *top_left = &table[y1*stride + x1*4];
+    const double *top_right = &table[y1*stride + x2*4];
+    const double *bottom_left = &table[y2*stride + x1*4];
+    const double *bottom_right = &table[y2*stride + x2*4];
+
+    Vec4f result;
+    for(int c = 0; c < 4; ++c)
+        result[c] = float((bottom_right[c] - bottom_left[c]) - (top_right[c] - top_left[c]));
+    return result;
+}
+
+bool Mosaic::SummedAreaTable::CanRender(const Options &options, const Rect &output_rect) const
+{
+    if(source == nullptr)
+        return false;
+
+    ColorBuckets color_buckets(source->width, source->height, options.block_size, options.angle, options.origin_x, options.origin_y);
+    if(!color_buckets.axis_aligned)
+        return false;
+
+    Rect needed = GetBlockRect(color_buckets, source->width, source->height, output_rect);
+    return needed.IsEmpty() ||
+        (needed.x1 >= rect.x1 && needed.y1 >= rect.y1 && needed.x2 <= rect.x2 && needed.y2 <= rect.y2);
+}
+
+void Mosaic::SummedAreaTable::Render(const Options &options, Image &output) const
+{
+    Render(options, Rect { 0, 0, source->width, source->height }, output);
+}
+
+void Mosaic::SummedAreaTable::Render(const Options &options, const Rect &output_rect, Image &output) const
+{
+    const Image &image = *source;
+    ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+    Rect out_rect = IntersectRect(output_rect, Rect { 0, 0, image.width, image.height });
+    int out_width = max(out_rect.x2 - out_rect.x1, 0), out_height = max(out_rect.y2 - out_rect.y1, 0);
+    output.width = out_width;
+    output.height = out_height;
+    ResizeUninitialized(output.rgba, size_t(out_width) * out_height);
+    if(out_rect.IsEmpty())
+        return;
+
+    // Every block is a rectangle made of one run of columns and one run of rows.  Find
+    // the runs of the blocks that overlap out_rect.
+    Rect block_rect = GetBlockRect(color_buckets, image.width, image.height, out_rect);
+    AxisAlignedRuns runs(color_buckets, image.width, image.height);
+    vector<pair<int,int>> column_runs;
+    runs.for_each_run(block_rect.y1, block_rect.x1, block_rect.x2, [&](int x_start, int x_end, int) {
+        column_runs.push_back(make_pair(x_start, x_end));
+    });
+
+    vector<int> row_run_starts;
+    vector<int> row_run_of_row(out_height);
+    for(int y = block_rect.y1; y < block_rect.y2; ++y)
+    {
+        if(y == block_rect.y1 || runs.row_offsets[y] != runs.row_offsets[y-1])
+            row_run_starts.push_back(y);
+        if(y >= out_rect.y1 && y < out_rect.y2)
+            row_run_of_row[y - out_rect.y1] = int(row_run_starts.size()) - 1;
+    }
+    row_run_starts.push_back(block_rect.y2);
+
+    // Find the color of each block.
+    int threads = GetThreadCount(options);
+    int columns = int(column_runs.size());
+    int row_runs = int(row_run_starts.size()) - 1;
+    vector<Vec4f> colors(size_t(columns) * row_runs);
+    ParallelFor(row_runs, threads, [&](int row_run) {
+        int y1 = row_run_starts[row_run], y2 = row_run_starts[row_run+1];
+        Vec4f *row_colors = &colors[size_t(row_run) * columns];
+        for(int i = 0; i < columns; ++i)
+            row_colors[i] = get_sum(column_runs[i].first, y1, column_runs[i].second, y2);
+        Vec4fKernels::Normalize(row_colors, columns);
+    });
+
+    // Write the output.  This copies each row of the source and writes the colors over it,
+    // which leaves alpha alone, the same as ApplyMosaic.
+    const int rows_per_chunk = 16;
+    ParallelFor((out_height + rows_per_chunk - 1) / rows_per_chunk, threads, [&](int chunk) {
+        int y_end = min(out_rect.y2, out_rect.y1 + (chunk+1) * rows_per_chunk);
+        for(int y = out_rect.y1 + chunk * rows_per_chunk; y < y_end; y++)
+        {
+            Vec4f *row = output.rgba.data() + size_t(y - out_rect.y1) * out_width;
+            const Vec4f *source_row = &image.ptr(out_rect.x1, y);
+            copy(source_row, source_row + out_width, row);
+
+            const Vec4f *row_colors = &colors[size_t(row_run_of_row[y - out_rect.y1]) * columns];
+            for(int i = 0; i < columns; ++i)
+            {
+                int x_start = max(column_runs[i].first, out_rect.x1);
+                int x_end = min(column_runs[i].second, out_rect.x2);
+                Vec4fKernels::WriteRun(row + x_start - out_rect.x1, x_end - x_start, row_colors[i]);
+            }
+        }
+    });
+}
+
+bool Mosaic::Plan::Matches(int width_, int height_, const Options &options_) const
+{
+    return valid && width == width_ && height == height_ && options == options_;
+}
+
+// The Engine's memory.  This is only a RenderBuffers, but is declared in Engine so the
+// header doesn't need to know about it.
+struct Mosaic::Engine::Buffers: RenderBuffers
+{
+};
+
+Mosaic::Engine::Engine():
+    buffers(new Buffers())
+{
+}
+
+Mosaic::Engine::~Engine()
+{
+}
+
+void Mosaic::Engine::ApplyMosaic(const ImageView &image, const Options &options)
+{
+    // Sequences usually render the same size and options frame after frame.  Once the
+    // same size and options are rendered twice in a row, build a plan for them, and keep
+    // using it until they change.
+    bool repeated = image.width == last_width && image.height == last_height && options == last_options;
+    last_width = image.width;
+    last_height = image.height;
+    last_options = options;
+
+    // Plans always use a dense grid.  Don't use them for grids large enough that tiled or
+    // sparse storage would be used instead.
+    bool use_plan = repeated && options.traversal == Traversal::Auto && options.bucket_layout == BucketLayout::Auto;
+    if(use_plan && !plan.Matches(image.width, image.height, options))
+    {
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        use_plan = size_t(color_buckets.grid_width) * color_buckets.grid_height <= max_dense_buckets;
+    }
+
+    if(use_plan)
+        ApplyWithPlan(image, options, plan, *buffers);
+    else
+        ApplyInPlace(image, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const ConstImageView &input, const Options &options, const ImageView &output)
+{
+    RenderRect(input, 0, 0, options, Rect { 0, 0, input.width, input.height }, output, 0, 0, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const ImageView &image, const Options &options, Plan &plan)
+{
+    ApplyWithPlan(image, options, plan, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const BasicImageView<Rgba8> &image, const Options &options)
+{
+    ApplyPixels(image, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const BasicImageView<Argb8> &image, const Options &options)
+{
+    ApplyPixels(image, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const BasicImageView<Rgba16> &image, const Options &options)
+{
+    ApplyPixels(image, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaic(const BasicImageView<RgbaHalf> &image, const Options &options)
+{
+    ApplyPixels(image, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaicLayers(const vector<ImageView> &layers, const Options &options)
+{
+    // A single layer is an ordinary image, which can use plans and the other traversals.
+    if(layers.size() == 1)
+        ApplyMosaic(layers[0], options);
+    else
+        ApplyLayers(layers, options, *buffers);
+}
+
+void Mosaic::Engine::ApplyMosaicToRect(const Image &input, int input_x, int input_y, const Options &options, const Rect &output_rect, Image &output)
+{
+    Rect rect = IntersectRect(
+        Rect { output_rect.x1 - input_x, output_rect.y1 - input_y, output_rect.x2 - input_x, output_rect.y2 - input_y },
+        Rect { 0, 0, input.width, input.height });
+    if(rect.IsEmpty())
+        rect = Rect();
+
+    // Size the output, unless we're rendering in place.  The input is copied to it
+    // as it's written.
+    int output_x = 0, output_y = 0;
+    if(&output != &input)
+    {
+        output.width = rect.x2 - rect.x1;
+        output.height = rect.y2 - rect.y1;
+        ResizeUninitialized(output.rgba, size_t(output.width) * output.height);
+        output_x = rect.x1;
+        output_y = rect.y1;
+    }
+
+    RenderRect(input, input_x, input_y, options, rect, output, output_x, output_y, *buffers);
+}
+
+size_t Mosaic::Engine::GetMemoryUsage() const
+{
+    return buffers->get_memory_usage() +
+        plan.runs.capacity() * sizeof(Plan::Run) +
+        plan.row_starts.capacity() * sizeof(int);
+}
+
+void Mosaic::Engine::Release()
+{
+    buffers.reset(new Buffers());
+    plan = Plan();
+    last_width = last_height = 0;
+}
+
+namespace Mosaic
+{
+    void ApplyMosaic(Image &image, const Options &options)
+    {
+        Engine().ApplyMosaic(ImageView(image), options);
+    }
+
+    void ApplyMosaic(const ImageView &image, const Options &options)
+    {
+        Engine().ApplyMosaic(image, options);
+    }
+
+    void ApplyMosaic(const Image &input, const Options &options, Image &output)
+    {
+        Engine().ApplyMosaicToRect(input, 0, 0, options, Rect { 0, 0, input.width, input.height }, output);
+    }
+
+    void ApplyMosaic(const ConstImageView &input, const Options &options, const ImageView &output)
+    {
+        Engine().ApplyMosaic(input, options, output);
+    }
+
+    Rect GetInputRect(int image_width, int image_height, const Options &options, const Rect &output_rect)
+    {
+        ColorBuckets color_buckets(image_width, image_height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        return GetBlockRect(color_buckets, image_width, image_height, output_rect);
+    }
+
+    bool IsAxisAligned(const Options &options)
+    {
+        return ColorBuckets(1, 1, options.block_size, options.angle, options.origin_x, options.origin_y).axis_aligned;
+    }
+
+    void ApplyMosaic(Image &image, const Options &options, const Rect &rect)
+    {
+        Engine().ApplyMosaicToRect(image, 0, 0, options, rect, image);
+    }
+
+    void ApplyMosaicToRect(const Image &input, int input_x, int input_y, const Options &options, const Rect &output_rect, Image &output)
+    {
+        Engine().ApplyMosaicToRect(input, input_x, input_y, options, output_rect, output);
+    }
+
+    void ApplyMosaicPyramid(const Image &image, const Options &options, const vector<float> &block_sizes, vector<Image> &results)
+    {
+        results.resize(block_sizes.size());
+        if(block_sizes.empty())
+            return;
+
+        // Rotated grids are no faster in one pass, since the fixed-point mapping of each
+        // level costs as much as summing its pixels, so render each block size separately.
+        if(!IsAxisAligned(options))
+        {
+            Engine engine;
+            for(size_t i = 0; i < block_sizes.size(); ++i)
+            {
+                Options level_options = options;
+                level_options.block_size = block_sizes[i];
+                engine.ApplyMosaicToRect(image, 0, 0, level_options, Rect { 0, 0, image.width, image.height }, results[i]);
+            }
+            return;
+        }
+
+        vector<PyramidLevel> levels;
+        vector<int> result_levels = GetPyramidLevels(block_sizes, levels);
+        for(PyramidLevel &level: levels)
+            level.color_buckets.reset(new ColorBuckets(image.width, image.height, level.block_size, options.angle, options.origin_x, options.origin_y));
+
+        int threads = GetThreadCount(options);
+        TileOccupancy occupancy;
+        ScanOccupancy(image, occupancy, threads);
+
+        ApplyPyramidWithRuns<AxisAlignedRuns>(image, occupancy, levels, result_levels, results, [&](const ColorBuckets &color_buckets) {
+            return AxisAlignedRuns(color_buckets, image.width, image.height);
+        }, threads);
+    }
+
+    vector<float> GetPowerOfTwoBlockSizes(float block_size, int levels)
+    {
+        vector<float> result;
+        for(int i = 0; i < levels; ++i)
+            result.push_back(ldexpf(block_size, i));
+        return result;
+    }
+
+    float ApplyMosaicApproximate(const Image &image, const Options &options, int samples_per_block, Image &output)
+    {
+        return ApplyMosaicApproximate(image, options, samples_per_block, Rect { 0, 0, image.width, image.height }, output);
+    }
+
+    float ApplyMosaicApproximate(const Image &image, const Options &options, int samples_per_block, const Rect &output_rect, Image &output)
+    {
+        // Sampling fewer than one pixel in 16 doesn't save enough to make up for its
+        // overhead, so small blocks are rendered exactly.
+        const int min_step = 4;
+        int step = int(options.block_size / max(samples_per_block, 1));
+        if(step < min_step)
+        {
+            ApplyMosaicToRect(image, 0, 0, options, output_rect, output);
+            return 0;
+        }
+
+        Rect rect = IntersectRect(output_rect, Rect { 0, 0, image.width, image.height });
+        if(rect.IsEmpty())
+            rect = Rect();
+
+        // Size the output, unless we're rendering in place.
+        int output_x = 0, output_y = 0;
+        if(&output != &image)
+        {
+            output.width = rect.x2 - rect.x1;
+            output.height = rect.y2 - rect.y1;
+            ResizeUninitialized(output.rgba, size_t(output.width) * output.height);
+            output_x = rect.x1;
+            output_y = rect.y1;
+        }
+
+        if(rect.IsEmpty())
+            return 0;
+
+        // Only sample the blocks overlapping rect, and size the grid to hold just those.
+        ColorBuckets color_buckets(image.width, image.height, options.block_size, options.angle, options.origin_x, options.origin_y);
+        Rect input_rect = GetBlockRect(color_buckets, image.width, image.height, rect);
+        color_buckets.fit_grid(input_rect.x1, input_rect.y1, input_rect.x2, input_rect.y2);
+
+        int threads = GetThreadCount(options);
+        color_buckets.allocate(Mosaic::BucketLayout::RowMajor, threads);
+        if(color_buckets.axis_aligned)
+            return ApplyApproximateWithRuns(image, input_rect, rect, color_buckets, AxisAlignedRuns(color_buckets, image.width, image.height), step, output, output_x, output_y, threads);
+        else
+            return ApplyApproximateWithRuns(image, input_rect, rect, color_buckets, RotatedRuns(color_buckets, image.width), step, output, output_x, output_y, threads);
+    }
+
+    void ApplyMosaic(Image &image, const Options &options, Plan &plan)
+    {
+        Engine().ApplyMosaic(ImageView(image), options, plan);
+    }
+
+    void ApplyMosaic(const ImageView &image, const Options &options, Plan &plan)
+    {
+        Engine().ApplyMosaic(image, options, plan);
+    }
+
+    void ApplyMosaicLayers(const vector<ImageView> &layers, const Options &options)
+    {
+        Engine().ApplyMosaicLayers(layers, options);
+    }
+
+    void ApplyMosaic(const BasicImageView<Rgba8> &image, const Options &options)
+    {
+        Engine().ApplyMosaic(image, options);
+    }
+
+    void ApplyMosaic(const BasicImageView<Argb8> &image, const Options &options)
+    {
+        Engine().ApplyMosaic(image, options);
+    }
+
+    void ApplyMosaic(const BasicImageView<Rgba16> &image, const Options &options)
+    {
+        Engine().ApplyMosaic(image, options);
+    }
+
+    void ApplyMosaic(const BasicImageView<RgbaHalf> &image, const Options &options)
+    {
+        Engine().ApplyMosaic(image, options);
+    }
+
+    void ApplyMosaic(MultiChannelImage &image, const Options &options)
+    {
+        Engine().ApplyMosaicLayers(image.GetColorGroupViews(), options);
+    }
+
+
+};
@@ -3,21 +3,303 @@
 
 #include "Image.h"
 
+#include <memory>
 #include <vector>
 using namespace std;
 
 namespace Mosaic
 {
+    // How ApplyMosaic walks the image.  These all give the same result, other than
+    // floating-point rounding, and only affect performance.
+    enum class Traversal
+    {
+        // Choose automatically.
+        Auto,
+
+        // Sum the whole image into buckets in raster order, then write the whole
+        // image back from the buckets.
+        Raster,
+
+        // Handle one block at a time: find the pixels inside the block, sum them, and
+        // write them back right away.  This only applies to rotated grids.  Axis-aligned
+        // grids always use Raster.
+        BlockMajor,
+    };
+
+    // How the grid of buckets is stored.  This only affects performance.
+    enum class BucketLayout
+    {
+        // Store buckets in rows, or sparsely if the image's content only reaches a small
+        // part of a large grid.
+        Auto,
+
+        // Store buckets in rows.
+        RowMajor,
+
+        // Store buckets in small square tiles, so buckets that are near each other in the
+        // image are near each other in memory.  This can help when the grid is much larger
+        // than the cache, with small blocks on rotated grids, but is slower for others, so
+        // it's never chosen automatically.
+        Tiled,
+    };
+
+    // A rectangle of pixels, from (x1, y1) up to but not including (x2, y2).
+    struct Rect
+    {
+        int x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+
+        bool IsEmpty() const { return x1 >= x2 || y1 >= y2; }
+        bool operator==(const Rect &rhs) const { return x1 == rhs.x1 && y1 == rhs.y1 && x2 == rhs.x2 && y2 == rhs.y2; }
+    };
+
     struct Options
     {
         float block_size = 16;
         float angle = 0;
         int origin_x = 0;
         int origin_y = 0;
+
+        // Settings below this only affect performance, not the result, so they aren't
+        // compared by operator==.
+        Traversal traversal = Traversal::Auto;
+
+        // The number of threads to use from the shared ThreadPool.  If 0, use all of them.
+        // The result is exactly the same for any number of threads and any bucket layout.
+        int threads = 0;
+
+        BucketLayout bucket_layout = BucketLayout::Auto;
+
         bool operator==(const Options &rhs) const;
     };
 
+    // The mapping from pixels to buckets for one image size and set of options, stored
+    // as runs of pixels on each row that go to the same bucket.
+    //
+    // When mosaicing a sequence of images with the same size and options, pass the same
+    // Plan to each call to ApplyMosaic, and the mapping will only be computed once.  If the
+    // size or options change, the plan is rebuilt automatically.
+    struct Plan
+    {
+        struct Run
+        {
+            // Each run starts where the previous run on the row ended.
+            int x_end;
+
+            // The offset of the bucket in the bucket grid.
+            int bucket;
+        };
+
+        bool Matches(int width, int height, const Options &options) const;
+
+        bool valid = false;
+        int width = 0, height = 0;
+        Options options;
+
+        // The runs on row y are runs[row_starts[y]] through runs[row_starts[y+1]-1].
+        vector<Run> runs;
+        vector<int> row_starts;
+    };
+
+    // Renders the mosaic, keeping its working memory from one render to the next.  The
+    // free functions below allocate the bucket grid and occupancy map for every call and
+    // throw them away.  Rendering a sequence of frames or preview updates with one Engine
+    // reuses them, so later renders don't pay to allocate and fault in the same memory
+    // again.  If the same size and options are rendered repeatedly, the Engine also builds
+    // and keeps a Plan for them.
+    //
+    // The memory is kept until Release is called or the Engine is destroyed, sized for the
+    // largest render so far.  Only one thread can render with an Engine at a time.  Work is
+    // run on the shared ThreadPool.
+    class Engine
+    {
+    public:
+        Engine();
+        ~Engine();
+
+        // These are the same as the free functions with the same names.
+        void ApplyMosaic(const ImageView &image, const Options &options);
+        void ApplyMosaic(const ConstImageView &input, const Options &options, const ImageView &output);
+        void ApplyMosaic(const ImageView &image, const Options &options, Plan &plan);
+        void ApplyMosaicLayers(const vector<ImageView> &layers, const Options &options);
+        void ApplyMosaic(const BasicImageView<Rgba8> &image, const Options &options);
+        void ApplyMosaic(const BasicImageView<Argb8> &image, const Options &options);
+        void ApplyMosaic(const BasicImageView<Rgba16> &image, const Options &options);
+        void ApplyMosaic(const BasicImageView<RgbaHalf> &image, const Options &options);
+        void ApplyMosaicToRect(const Image &input, int input_x, int input_y, const Options &options, const Rect &output_rect, Image &output);
+
+        // Return the number of bytes the Engine is holding on to between renders.
+        size_t GetMemoryUsage() const;
+
+        // Free the memory kept between renders.  It's allocated again by the next render.
+        void Release();
+
+    private:
+        Engine(const Engine &) = delete;
+        Engine &operator=(const Engine &) = delete;
+
+        struct Buffers;
+        unique_ptr<Buffers> buffers;
+
+        // The plan for the most recent size and options, and the size and options of the
+        // last render, to tell when they're repeated.
+        Plan plan;
+        int last_width = 0, last_height = 0;
+        Options last_options;
+    };
+
+    // A summed-area table of part of an image, for rendering the mosaic of the same image
+    // many times with different options, such as while the user scrubs the block size.
+    // Building the table reads every pixel in it once.  After that, rendering an
+    // axis-aligned grid only does work for each block to find its color, plus one pass to
+    // write the output.
+    //
+    // The table is stored as doubles, so sums over large areas don't lose precision, and
+    // uses 32 bytes per pixel, twice the image itself.  Build it over only the part of the
+    // image that will be rendered, such as the area around a preview.  Rotated grids can't
+    // use the table.
+    class SummedAreaTable
+    {
+    public:
+        // Build the table over the pixels of image inside rect.
+        void Build(shared_ptr<const Image> image, const Rect &rect);
+        void Build(shared_ptr<const Image> image);
+        bool IsBuilt() const { return source != nullptr; }
+
+        // Return the part of the image the table covers.
+        const Rect &GetRect() const { return rect; }
+
+        // Free the table.
+        void Release();
+
+        // Return true if output_rect of the mosaic can be rendered from the table: the grid
+        // is axis-aligned, and every block overlapping output_rect is inside the table.
+        bool CanRender(const Options &options, const Rect &output_rect) const;
+
+        // Render output_rect of the mosaic into output, which is resized to output_rect
+        // clipped to the image.  CanRender must be true.  The result matches
+        // ApplyMosaicToRect to within float rounding.
+        void Render(const Options &options, const Rect &output_rect, Image &output) const;
+
+        // Render the whole mosaic.  The table must cover the whole image.
+        void Render(const Options &options, Image &output) const;
+
+    private:
+        // Return the sum of the pixels in [x1,x2) x [y1,y2), in image coordinates.
+        Vec4f get_sum(int x1, int y1, int x2, int y2) const;
+
+        shared_ptr<const Image> source;
+        Rect rect;
+
+        // The sum of all pixels in rect above and to the left of each pixel, as four doubles
+        // per entry, with an extra row and column of zeroes at the top and left.
+        vector<double> table;
+    };
+
     void ApplyMosaic(Image &image, const Options &options);
+
+    // Render the mosaic of input into output, without changing input.  Each row is copied
+    // to output just before its colors are written, so this is cheaper than copying the
+    // image and rendering in place.  If output is input, this renders in place.  This always
+    // uses the raster traversal, and gives exactly the same result as it does in place.
+    void ApplyMosaic(const Image &input, const Options &options, Image &output);
+
+    // Apply the mosaic using plan, first rebuilding it if it doesn't match the image
+    // and options.
+    void ApplyMosaic(Image &image, const Options &options, Plan &plan);
+
+    // The same as the above, on pixels owned by the caller.  These render directly into
+    // the caller's rows, so hosts with premultiplied float pixels don't need to copy them
+    // into an Image.  For the out-of-place version, input and output must be the same size,
+    // and output may be input.
+    void ApplyMosaic(const ImageView &image, const Options &options);
+    void ApplyMosaic(const ConstImageView &input, const Options &options, const ImageView &output);
+    void ApplyMosaic(const ImageView &image, const Options &options, Plan &plan);
+
+    // Apply the mosaic to several images of the same size at once, such as the passes of a
+    // render.  Every layer uses the same blocks and the alpha of the first layer: each
+    // layer's color for a block is its sum over the block divided by the sum of the first
+    // layer's alpha, and is written back multiplied by the first layer's alpha.  All four
+    // channels of the other layers are colors.
+    //
+    // The first layer comes out exactly as ApplyMosaic would render it, and each channel of
+    // the others the same as mosaicing it with the first layer's alpha, but pixels are only
+    // mapped to blocks once for all of them.  With more than one layer, this always uses
+    // the raster traversal.
+    void ApplyMosaicLayers(const vector<ImageView> &layers, const Options &options);
+
+    // Apply the mosaic to the color channels of a multi-channel image with ApplyMosaicLayers.
+    // Groups after image.color_groups are left alone.
+    void ApplyMosaic(MultiChannelImage &image, const Options &options);
+
+    // Apply the mosaic in place to compact pixels, without expanding them to Vec4f.  Each
+    // pixel is converted to float as it's read, and blocks are summed in float or double as
+    // usual.  The sums are exactly the same as for the image converted to Vec4f, so the
+    // result only differs from ApplyMosaic on the converted image by the rounding of the
+    // final colors to the format.  Like the converted image, transparent pixels come out
+    // black, even where they had a straight color.  These always use the raster traversal.
+    //
+    // Rgba8 and Argb8 are summed in 32-bit integers instead, as color times alpha, and never
+    // converted to float.  The sums are exact, and each block's color is rounded from them,
+    // so the result is within one value of the float path.  Blocks larger than 128 pixels
+    // could overflow the sums, so they use the float path.
+    void ApplyMosaic(const BasicImageView<Rgba8> &image, const Options &options);
+    void ApplyMosaic(const BasicImageView<Argb8> &image, const Options &options);
+    void ApplyMosaic(const BasicImageView<Rgba16> &image, const Options &options);
+    void ApplyMosaic(const BasicImageView<RgbaHalf> &image, const Options &options);
+
+    // Apply the mosaic to the pixels of image inside rect, leaving the rest of the image
+    // alone.  The result inside rect is exactly the same as ApplyMosaic on the whole image.
+    // Only the pixels in GetInputRect are read.
+    void ApplyMosaic(Image &image, const Options &options, const Rect &rect);
+
+    // Return the part of an image of the given size that's needed to render output_rect
+    // of its mosaic: every pixel in a block that overlaps output_rect.  For axis-aligned
+    // grids this is exactly the blocks overlapping output_rect.  For rotated grids it's
+    // output_rect grown by the size of a block, which includes the corners of blocks.
+    Rect GetInputRect(int image_width, int image_height, const Options &options, const Rect &output_rect);
+
+    // Return true if the grid is axis-aligned: its angle is a multiple of 90 degrees.
+    bool IsAxisAligned(const Options &options);
+
+    // Render the part of the mosaic inside output_rect into output, for hosts that only
+    // fetch part of the image.  input is the part of the image with its top-left corner
+    // at (input_x, input_y), and should cover GetInputRect for output_rect.  Only the
+    // pixels of input in GetInputRect are read.  output_rect is in image coordinates, and
+    // output is resized to output_rect clipped to input.
+    void ApplyMosaicToRect(const Image &input, int input_x, int input_y, const Options &options, const Rect &output_rect, Image &output);
+
+    // Render the mosaic of image at each of block_sizes, with the angle and origin from
+    // options, into results.  options.block_size is ignored.
+    //
+    // For axis-aligned grids, the image is only read once.  When a block size is a whole
+    // multiple of a smaller one, its grid nests inside the smaller grid, and its buckets are
+    // found by combining the smaller buckets instead of summing pixels again.  Nested grids
+    // assign pixels exactly as the finer grid does, so pixels right on a block edge may land
+    // in a different block than separate ApplyMosaic calls would put them in due to rounding.
+    // Rotated grids are rendered with a separate ApplyMosaic for each block size.
+    void ApplyMosaicPyramid(const Image &image, const Options &options, const vector<float> &block_sizes, vector<Image> &results);
+
+    // Return levels block sizes, starting at block_size and doubling each time.
+    vector<float> GetPowerOfTwoBlockSizes(float block_size, int levels);
+
+    // Render an approximate mosaic of image into output for interactive previews, estimating
+    // each block's color from a subset of its pixels.  output may be image.  The image is divided into square cells about
+    // 1/samples_per_block of a block across, and one pixel is sampled from each, at a
+    // position jittered by a hash of the cell.  Blocks too small to contain any sample are
+    // summed exactly.  The samples only depend on the image and options, so the same
+    // settings always give the same preview.
+    //
+    // Return an estimate of the largest error of any block's color: three standard errors
+    // of the worst block's estimate, or its whole color if it only got one sample.  If
+    // cells would be less than 4 pixels across, this is the same as ApplyMosaic, and
+    // returns 0.
+    float ApplyMosaicApproximate(const Image &image, const Options &options, int samples_per_block, Image &output);
+
+    // The same, rendering only the part of the mosaic inside output_rect, like
+    // ApplyMosaicToRect.  Only the blocks overlapping output_rect are sampled, and the error
+    // is only for those blocks.  output is resized to output_rect clipped to the image,
+    // unless it's image.
+    float ApplyMosaicApproximate(const Image &image, const Options &options, int samples_per_block, const Rect &output_rect, Image &output);
 }
 
 #endif
@@ -0,0 +1,204 @@
+#ifndef PixelFormats_h
+#define PixelFormats_h
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "Vec4f.h"
+
+// Compact pixel formats, for images that take too much memory as Vec4f.  The mosaic reads
+// and writes these directly, converting each pixel as it goes and summing in float, so
+// images are never expanded to Vec4f.
+//
+// Rgba8 and Rgba16 hold straight (unpremultiplied) color from 0 to the largest value,
+// like PNG files.  Premultiplying integer color throws away most of the precision of
+// transparent pixels.  RgbaHalf holds premultiplied color like Vec4f and EXR files.
+//
+// Like Vec4f, only the alpha channel is treated specially, so the color channels can be in
+// any order.  Argb8 is Rgba8 with alpha first, like After Effects and Photoshop pixels.
+struct Rgba8
+{
+    uint8_t r, g, b, a;
+};
+
+struct Argb8
+{
+    uint8_t a, r, g, b;
+};
+
+struct Rgba16
+{
+    uint16_t r, g, b, a;
+};
+
+// Each channel is the bits of an IEEE half float.
+struct RgbaHalf
+{
+    uint16_t r, g, b, a;
+};
+
+// Conversions between float and IEEE half floats.  These are called for every channel of
+// every pixel, so they avoid branches that depend on the value, other than for infinity
+// and NaN.
+namespace HalfFloat
+{
+    inline float AsFloat(uint32_t bits)
+    {
+        float result;
+        memcpy(&result, &bits, sizeof(result));
+        return result;
+    }
+
+    inline uint32_t AsBits(float f)
+    {
+        uint32_t result;
+        memcpy(&result, &f, sizeof(result));
+        return result;
+    }
+
+    inline float ToFloat(uint16_t h)
+    {
+        // Put the exponent and mantissa in place, and scale by 2^112 to go from the half's
+        // exponent bias to float's.  This is exact, and handles denormals too, unless the
+        // host has set the CPU to treat denormals as zero, which only loses values below 2^-14.
+        uint32_t magnitude = uint32_t(h & 0x7FFF) << 13;
+        uint32_t bits = AsBits(AsFloat(magnitude) * AsFloat(uint32_t(127 + 112) << 23));
+
+        // Infinity and NaN.  NaNs come out quiet, like the hardware conversion.
+        if((h & 0x7C00) == 0x7C00)
+            bits = 0x7F800000 | magnitude | ((h & 0x3FF)? 0x400000:0);
+
+        return AsFloat(bits | (uint32_t(h & 0x8000) << 16));
+    }
+
+    // Round f to the nearest half, with ties to even.
+    inline uint16_t FromFloat(float f)
+    {
+        uint32_t bits = AsBits(f);
+        uint32_t sign = (bits >> 16) & 0x8000;
+        uint32_t magnitude = bits & 0x7FFFFFFF;
+
+        // Anything that rounds to 65520 or more is infinity.  NaNs stay NaN.
+        if(magnitude >= 0x477FF000)
+            return uint16_t(sign | (magnitude > 0x7F800000? 0x7E00:0x7C00));
+
+        // Below 2^-14 the result is denormal or zero.  Adding 0.5 shifts the value down
+        // so its units of 2^-24 are the low bits of the mantissa, and the addition rounds
+        // it to the nearest one.
+        if(magnitude < 0x38800000)
+        {
+            const uint32_t denormal_magic = uint32_t(126) << 23;
+            return uint16_t(sign | (AsBits(AsFloat(magnitude) + AsFloat(denormal_magic)) - denormal_magic));
+        }
+
+        // Rebias the exponent and round away the low 13 bits of the mantissa, with ties to
+        // even.  Rounding up can carry into the exponent, which is still the right answer.
+        uint32_t odd = (magnitude >> 13) & 1;
+        magnitude += (uint32_t(15 - 127) << 23) + 0xFFF + odd;
+        return uint16_t(sign | (magnitude >> 13));
+    }
+}
+
+// How the mosaic reads and writes each format:
+//
+// Load(p) returns p as a premultiplied Vec4f.
+//
+// Writer(color).Store(p) sets p to a block's color, as given by Vec4fKernels::Normalize,
+// leaving its alpha alone.  A block's color is written to many pixels, so Writer converts
+// it once for all of them where it can.
+//
+// IsEmpty(p) is true if Load(p) is all zeroes.
+//
+// ClearEmpty(p) sets an empty pixel to what the float path gives it.  Straight color is
+// kept by transparent pixels, but premultiplying it away leaves them black, so Store and
+// ClearEmpty zero the color of transparent pixels.
+template<typename Pixel>
+struct PixelTraits;
+
+template<typename Channel, int MaxValue>
+struct UnormPixelTraits
+{
+    static float ToFloat(Channel value) { return value / float(MaxValue); }
+
+    // This clamps and rounds the same way as writing a float image to a PNG.
+    static Channel FromFloat(float value)
+    {
+        if(value < 0) value = 0;
+        if(value > 1) value = 1;
+        return Channel(lrintf(value * float(MaxValue)));
+    }
+
+    template<typename Pixel>
+    static Vec4f Load(const Pixel &p)
+    {
+        float alpha = ToFloat(p.a);
+        return Vec4f(ToFloat(p.r) * alpha, ToFloat(p.g) * alpha, ToFloat(p.b) * alpha, alpha);
+    }
+
+    // Straight color is just the block's color, so it's the same for every pixel.
+    struct Writer
+    {
+        Writer(const Vec4f &color):
+            r(FromFloat(color.x)), g(FromFloat(color.y)), b(FromFloat(color.z))
+        {
+        }
+
+        template<typename Pixel>
+        void Store(Pixel &p) const
+        {
+            Channel mask = p.a? Channel(MaxValue):Channel(0);
+            p.r = r & mask;
+            p.g = g & mask;
+            p.b = b & mask;
+        }
+
+        Channel r, g, b;
+    };
+
+    template<typename Pixel>
+    static bool IsEmpty(const Pixel &p) { return p.a == 0; }
+
+    // Only write pixels that change, so clean memory isn't dirtied.
+    template<typename Pixel>
+    static void ClearEmpty(Pixel &p)
+    {
+        if(p.r | p.g | p.b)
+            p.r = p.g = p.b = 0;
+    }
+};
+
+template<> struct PixelTraits<Rgba8>: UnormPixelTraits<uint8_t, 255> { };
+template<> struct PixelTraits<Argb8>: UnormPixelTraits<uint8_t, 255> { };
+template<> struct PixelTraits<Rgba16>: UnormPixelTraits<uint16_t, 65535> { };
+
+template<>
+struct PixelTraits<RgbaHalf>
+{
+    static Vec4f Load(const RgbaHalf &p)
+    {
+        return Vec4f(HalfFloat::ToFloat(p.r), HalfFloat::ToFloat(p.g), HalfFloat::ToFloat(p.b), HalfFloat::ToFloat(p.a));
+    }
+
+    struct Writer
+    {
+        Writer(const Vec4f &color_): color(color_) { }
+
+        void Store(RgbaHalf &p) const
+        {
+            float alpha = HalfFloat::ToFloat(p.a);
+            p.r = HalfFloat::FromFloat(color.x * alpha);
+            p.g = HalfFloat::FromFloat(color.y * alpha);
+            p.b = HalfFloat::FromFloat(color.z * alpha);
+        }
+
+        Vec4f color;
+    };
+
+    // Negative zero is empty too.
+    static bool IsEmpty(const RgbaHalf &p) { return ((p.r | p.g | p.b | p.a) & 0x7FFF) == 0; }
+
+    // Empty pixels are already zero.
+    static void ClearEmpty(RgbaHalf &) { }
+};
+
+#endif
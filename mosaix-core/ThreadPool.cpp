@@ -0,0 +1,329 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#endif
+
+namespace
+{
+    mutex shared_pool_lock;
+    ThreadPool *shared_pool = nullptr;
+    int configured_threads = 0;
+    bool configured_pinning = false;
+
+    // The pool and worker index of the current thread, if it's a worker.
+    thread_local ThreadPool *current_pool = nullptr;
+    thread_local int current_worker = -1;
+
+    void PinCurrentThread(int cpu)
+    {
+#if defined(_WIN32)
+        if(cpu < int(sizeof(DWORD_PTR)*8))
+            SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu);
+#elif defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+    }
+
+    // Return the NUMA node of each CPU, or an empty list if we can't tell.
+    vector<int> GetCpuNodes()
+    {
+        vector<int> result;
+#if defined(_WIN32)
+        // This only looks at the first processor group, which is also all PinCurrentThread
+        // can pin to.
+        ULONG highest_node = 0;
+        if(!GetNumaHighestNodeNumber(&highest_node) || highest_node == 0)
+            return result;
+
+        for(int cpu = 0; cpu < int(sizeof(DWORD_PTR)*8); ++cpu)
+        {
+            UCHAR node = 0;
+            if(!GetNumaProcessorNode(UCHAR(cpu), &node) || node == 0xFF)
+                break;
+            result.push_back(node);
+        }
+#elif defined(__linux__)
+        for(int node = 0; ; ++node)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+            FILE *file = fopen(path, "r");
+            if(file == nullptr)
+                break;
+
+            // The list looks like "0-3,8-11".
+            int first, last;
+            while(fscanf(file, "%d", &first) == 1)
+            {
+                last = first;
+                if(fscanf(file, "-%d", &last) != 1)
+                    last = first;
+                for(int cpu = first; cpu <= last; ++cpu)
+                {
+                    if(cpu >= int(result.size()))
+                        result.resize(cpu+1, 0);
+                    result[cpu] = node;
+                }
+                if(fgetc(file) != ',')
+                    break;
+            }
+            fclose(file);
+        }
+#endif
+        return result;
+    }
+
+    // Return the CPU the current thread is running on, or -1 if we can't tell.
+    int GetCurrentCpu()
+    {
+#if defined(_WIN32)
+        return int(GetCurrentProcessorNumber());
+#elif defined(__linux__)
+        return sched_getcpu();
+#else
+        return -1;
+#endif
+    }
+}
+
+ThreadPool &ThreadPool::Get()
+{
+    lock_guard<mutex> lock(shared_pool_lock);
+
+    // The pool is never destroyed automatically.  Joining threads from a static destructor
+    // can deadlock when we're in a DLL, so plugins call Shutdown instead.
+    if(shared_pool == nullptr)
+        shared_pool = new ThreadPool(configured_threads, configured_pinning);
+    return *shared_pool;
+}
+
+void ThreadPool::Configure(int threads, bool pin_threads)
+{
+    lock_guard<mutex> lock(shared_pool_lock);
+    configured_threads = threads;
+    configured_pinning = pin_threads;
+}
+
+void ThreadPool::Shutdown()
+{
+    lock_guard<mutex> lock(shared_pool_lock);
+    delete shared_pool;
+    shared_pool = nullptr;
+}
+
+ThreadPool::ThreadPool(int threads, bool pin_threads):
+    pending_tasks(0),
+    stopping(false),
+    next_queue(0)
+{
+    if(threads <= 0)
+        threads = max(1, int(thread::hardware_concurrency()));
+
+    cpu_nodes = GetCpuNodes();
+    node_count = cpu_nodes.empty()? 1:*max_element(cpu_nodes.begin(), cpu_nodes.end()) + 1;
+    if(node_count == 1)
+        cpu_nodes.clear();
+
+    // The thread calling ParallelFor does work too, so start one less worker.
+    for(int i = 0; i < threads-1; ++i)
+        workers.emplace_back(new Worker());
+
+    for(int i = 0; i < int(workers.size()); ++i)
+        workers[i]->worker_thread = thread(&ThreadPool::run_worker, this, i, pin_threads);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(idle_lock);
+        stopping = true;
+    }
+    idle_cond.notify_all();
+
+    for(auto &worker: workers)
+        worker->worker_thread.join();
+}
+
+void ThreadPool::submit(function<void()> task)
+{
+    // Tasks queued by a worker go on its own queue.  Spread tasks from other threads
+    // across the queues.
+    int queue = current_pool == this? current_worker:int(next_queue++ % workers.size());
+    {
+        lock_guard<mutex> lock(workers[queue]->lock);
+        workers[queue]->tasks.push_back(move(task));
+    }
+
+    {
+        lock_guard<mutex> lock(idle_lock);
+        pending_tasks++;
+    }
+    idle_cond.notify_one();
+}
+
+bool ThreadPool::pop_task(int worker, function<void()> &task)
+{
+    // Take the newest task from our own queue.
+    if(worker != -1)
+    {
+        Worker &own = *workers[worker];
+        lock_guard<mutex> lock(own.lock);
+        if(!own.tasks.empty())
+        {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            pending_tasks--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task from another queue.
+    int count = int(workers.size());
+    for(int i = 1; i <= count; ++i)
+    {
+        Worker &victim = *workers[(max(worker, 0) + i) % count];
+        lock_guard<mutex> lock(victim.lock);
+        if(!victim.tasks.empty())
+        {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            pending_tasks--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::run_worker(int worker, bool pin_thread)
+{
+    current_pool = this;
+    current_worker = worker;
+
+    // Leave CPU 0 for the thread calling ParallelFor.
+    if(pin_thread)
+        PinCurrentThread((worker + 1) % max(1, int(thread::hardware_concurrency())));
+
+    while(1)
+    {
+        function<void()> task;
+        if(pop_task(worker, task))
+        {
+            task();
+            continue;
+        }
+
+        unique_lock<mutex> lock(idle_lock);
+        idle_cond.wait(lock, [&] { return stopping || pending_tasks > 0; });
+        if(stopping)
+            break;
+    }
+}
+
+int ThreadPool::get_current_node() const
+{
+    if(cpu_nodes.empty())
+        return 0;
+
+    // Threads can move between CPUs, so this is only a hint.
+    int cpu = GetCurrentCpu();
+    return cpu >= 0 && cpu < int(cpu_nodes.size())? cpu_nodes[cpu]:0;
+}
+
+void ThreadPool::ParallelFor(int count, int max_threads, const function<void(int)> &f)
+{
+    int threads = max_threads > 0? min(max_threads, GetConcurrency()):GetConcurrency();
+    threads = min(threads, count);
+    if(threads <= 1)
+    {
+        for(int i = 0; i < count; ++i)
+            f(i);
+        return;
+    }
+
+    // Hand out work one item at a time, so threads that get cheap items pick up more of
+    // them.  Helper tasks may not start until after we return, so the job is shared with
+    // them, and they only touch f if they claim an item.
+    //
+    // Items are split into a range for each NUMA node.  Threads start on the range of
+    // their own node, and move on to the others when it runs out.
+    struct NodeRange
+    {
+        atomic<int> next_item;
+        int end;
+    };
+
+    struct Job
+    {
+        unique_ptr<NodeRange[]> ranges;
+        int nodes;
+        atomic<int> finished_items;
+        int count;
+        const function<void(int)> *f;
+        mutex lock;
+        condition_variable done;
+    };
+
+    int nodes = min(node_count, count);
+    shared_ptr<Job> job = make_shared<Job>();
+    job->ranges.reset(new NodeRange[nodes]);
+    for(int node = 0; node < nodes; ++node)
+    {
+        job->ranges[node].next_item = int(int64_t(count) * node / nodes);
+        job->ranges[node].end = int(int64_t(count) * (node+1) / nodes);
+    }
+    job->nodes = nodes;
+    job->finished_items = 0;
+    job->count = count;
+    job->f = &f;
+
+    auto run_items = [](Job &job, int node) {
+        int i, finished = 0;
+        for(int n = 0; n < job.nodes; ++n)
+        {
+            NodeRange &range = job.ranges[(node + n) % job.nodes];
+            while((i = range.next_item++) < range.end)
+            {
+                (*job.f)(i);
+                finished++;
+            }
+        }
+
+        if(finished > 0 && (job.finished_items += finished) == job.count)
+        {
+            lock_guard<mutex> lock(job.lock);
+            job.done.notify_all();
+        }
+    };
+
+    for(int i = 1; i < threads; ++i)
+        submit([this, job, run_items] { run_items(*job, get_current_node()); });
+
+    run_items(*job, get_current_node());
+
+    // Wait for items still running on other threads.  Run other queued work while we
+    // wait, so this thread isn't idle when ParallelFor is nested.
+    while(job->finished_items < count)
+    {
+        function<void()> task;
+        if(pop_task(current_pool == this? current_worker:-1, task))
+        {
+            task();
+            continue;
+        }
+
+        unique_lock<mutex> lock(job->lock);
+        job->done.wait(lock, [&] { return job->finished_items == count; });
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef ThreadPool_h
+#define ThreadPool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// A work-stealing thread pool shared by everything in the process.
+//
+// Each worker has its own queue of tasks.  Tasks queued from a worker go on that worker's
+// queue, and it runs them newest first while they're still in cache.  Idle workers steal
+// the oldest task from other queues.  Everything shares one set of threads, so running
+// several stages at once, or nesting ParallelFor inside ParallelFor, never starts more
+// threads than there are cores.
+class ThreadPool
+{
+public:
+    // Return the shared pool, starting it if it isn't running.
+    static ThreadPool &Get();
+
+    // Set the number of threads and whether to pin them to CPUs, which take effect the next
+    // time the pool starts.  threads includes the thread calling ParallelFor, so the pool
+    // starts threads-1 workers.  If threads is 0, use one thread per CPU core.
+    static void Configure(int threads, bool pin_threads);
+
+    // Stop the shared pool's threads.  Plugins call this before they're unloaded, since
+    // threads can't safely be joined while the DLL is being unloaded.  Nothing may be using
+    // the pool when this is called.  The pool restarts the next time Get is called.
+    static void Shutdown();
+
+    // Return the number of threads that can run ParallelFor work at once, including the
+    // calling thread.
+    int GetConcurrency() const { return int(workers.size()) + 1; }
+
+    // Return the number of NUMA nodes, or 1 if the system isn't NUMA or we can't tell.
+    int GetNodeCount() const { return node_count; }
+
+    // Call f(i) for each i in [0, count), using up to max_threads threads including this one.
+    // If max_threads is 0, use as many threads as the pool has.  This returns when every
+    // call is finished.
+    //
+    // On NUMA systems, the items are split in order into one range per node, and each thread
+    // takes items from the range of the node it's running on before helping with others.
+    // Items at the same fraction of count go to the same node every time, so memory first
+    // touched by one ParallelFor over the rows of an image is mostly local to the threads
+    // that work on the same rows in later ones.
+    void ParallelFor(int count, int max_threads, const function<void(int)> &f);
+
+    ~ThreadPool();
+
+private:
+    ThreadPool(int threads, bool pin_threads);
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    struct Worker
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+        thread worker_thread;
+    };
+
+    void submit(function<void()> task);
+    bool pop_task(int worker, function<void()> &task);
+    void run_worker(int worker, bool pin_thread);
+    int get_current_node() const;
+
+    vector<unique_ptr<Worker>> workers;
+
+    // The number of queued tasks, and a condition to wake idle workers when it changes.
+    atomic<int> pending_tasks;
+    mutex idle_lock;
+    condition_variable idle_cond;
+    atomic<bool> stopping;
+
+    // The queue external threads submit to next.
+    atomic<unsigned> next_queue;
+
+    // The NUMA node of each CPU, and the number of nodes.  cpu_nodes is empty if there's
+    // only one node.
+    vector<int> cpu_nodes;
+    int node_count = 1;
+};
+
+#endif
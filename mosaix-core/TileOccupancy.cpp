@@ -0,0 +1,132 @@
+#include "TileOccupancy.h"
+#include "Image.h"
+#include <algorithm>
+
+void TileOccupancy::Init(int width_, int height_)
+{
+    width = width_;
+    height = height_;
+    tiles_x = (width + TileSize - 1) / TileSize;
+    tiles_y = (height + TileSize - 1) / TileSize;
+    occupied.assign(tiles_x*tiles_y, 0);
+
+    // Clear the spans without freeing them, so reusing the map doesn't allocate them again.
+    spans.resize(tiles_y);
+    for(auto &row_spans: spans)
+        row_spans.clear();
+}
+
+namespace
+{
+    bool IsAreaEmpty(const ConstImageView &image, int x1, int y1, int x2, int y2)
+    {
+        // Stop as soon as we find a non-empty pixel.  Most tiles of a typical image are
+        // either entirely empty or have a visible pixel near the top.
+        for(int y = y1; y < y2; ++y)
+        {
+            const Vec4f *row = image.row(y);
+            for(int x = x1; x < x2; ++x)
+            {
+                const Vec4f &p = row[x];
+                if(p.x != 0 || p.y != 0 || p.z != 0 || p.w != 0)
+                    return false;
+            }
+        }
+        return true;
+    }
+}
+
+void TileOccupancy::ScanTileRow(const ConstImageView &image, int tile_y, int scan_x1, int scan_x2)
+{
+    ScanTileRow(tile_y, [&](int x1, int y1, int x2, int y2) {
+        return IsAreaEmpty(image, x1, y1, x2, y2);
+    }, scan_x1, scan_x2);
+}
+
+void TileOccupancy::ScanTileRow(const vector<ConstImageView> &images, int tile_y, int scan_x1, int scan_x2)
+{
+    ScanTileRow(tile_y, [&](int x1, int y1, int x2, int y2) {
+        for(const ConstImageView &image: images)
+        {
+            if(!IsAreaEmpty(image, x1, y1, x2, y2))
+                return false;
+        }
+        return true;
+    }, scan_x1, scan_x2);
+}
+
+void TileOccupancy::ScanTileRow(int tile_y, const function<bool(int x1, int y1, int x2, int y2)> &is_empty, int scan_x1, int scan_x2)
+{
+    int y1 = tile_y * TileSize;
+    int y2 = min(y1 + TileSize, height);
+    int first_tile = max(scan_x1, 0) / TileSize;
+    int end_tile = (min(scan_x2, width) + TileSize - 1) / TileSize;
+    for(int tile_x = first_tile; tile_x < end_tile; ++tile_x)
+    {
+        int x1 = tile_x * TileSize;
+        int x2 = min(x1 + TileSize, width);
+
+        occupied[tile_y*tiles_x + tile_x] = !is_empty(x1, y1, x2, y2);
+    }
+
+    // Merge neighboring occupied tiles into spans.
+    vector<pair<int,int>> &row_spans = spans[tile_y];
+    row_spans.clear();
+    for(int tile_x = 0; tile_x < tiles_x; ++tile_x)
+    {
+        if(!IsTileOccupied(tile_x, tile_y))
+            continue;
+
+        int x1 = tile_x * TileSize;
+        int x2 = min(x1 + TileSize, width);
+        if(!row_spans.empty() && row_spans.back().second == x1)
+            row_spans.back().second = x2;
+        else
+            row_spans.push_back(make_pair(x1, x2));
+    }
+}
+
+void TileOccupancy::Scan(const ConstImageView &image)
+{
+    Init(image.width, image.height);
+    for(int tile_y = 0; tile_y < tiles_y; ++tile_y)
+        ScanTileRow(image, tile_y);
+}
+
+bool TileOccupancy::IsAreaOccupied(int x1, int y1, int x2, int y2) const
+{
+    x1 = max(x1, 0);
+    y1 = max(y1, 0);
+    x2 = min(x2, width);
+    y2 = min(y2, height);
+    if(x1 >= x2 || y1 >= y2)
+        return false;
+
+    for(int tile_y = y1 / TileSize; tile_y <= (y2-1) / TileSize; ++tile_y)
+    {
+        for(int tile_x = x1 / TileSize; tile_x <= (x2-1) / TileSize; ++tile_x)
+        {
+            if(IsTileOccupied(tile_x, tile_y))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool TileOccupancy::IsAnyOccupied() const
+{
+    for(uint8_t tile: occupied)
+    {
+        if(tile)
+            return true;
+    }
+    return false;
+}
+
+size_t TileOccupancy::GetMemoryUsage() const
+{
+    size_t result = occupied.capacity() + spans.capacity() * sizeof(spans[0]);
+    for(const auto &row_spans: spans)
+        result += row_spans.capacity() * sizeof(row_spans[0]);
+    return result;
+}
@@ -0,0 +1,65 @@
+#ifndef TileOccupancy_h
+#define TileOccupancy_h
+
+#include "Image.h"
+#include <stdint.h>
+#include <limits.h>
+#include <functional>
+#include <vector>
+using namespace std;
+
+// A coarse map of which tiles of an image have any non-empty pixels.  A pixel is
+// empty if all of its channels are zero.  Images are premultiplied, so this includes
+// all completely transparent pixels.  Empty pixels don't change bucket sums, and
+// writing a bucket color to them leaves them empty, so work on empty tiles can be
+// skipped entirely.
+class TileOccupancy
+{
+public:
+    static const int TileSize = 64;
+
+    // Set up the map for an image of the given size, with all tiles empty.
+    void Init(int width, int height);
+
+    // Scan one row of tiles of image.  Separate rows can be scanned in parallel.  If
+    // x1 and x2 are given, only tiles overlapping columns [x1, x2) are scanned, and the
+    // rest are left empty.
+    void ScanTileRow(const ConstImageView &image, int tile_y, int x1 = 0, int x2 = INT_MAX);
+
+    // The same for several images of the same size, such as the layers of a multi-channel
+    // image.  A tile is occupied if it has a non-empty pixel in any of them.
+    void ScanTileRow(const vector<ConstImageView> &images, int tile_y, int x1 = 0, int x2 = INT_MAX);
+
+    // The same for images that aren't made of Vec4f.  is_empty(x1, y1, x2, y2) returns true
+    // if every pixel in [x1,x2) x [y1,y2) is empty.
+    void ScanTileRow(int tile_y, const function<bool(int x1, int y1, int x2, int y2)> &is_empty, int x1 = 0, int x2 = INT_MAX);
+
+    // Init and scan the whole image.
+    void Scan(const ConstImageView &image);
+
+    bool IsTileOccupied(int tile_x, int tile_y) const { return occupied[tile_y*tiles_x + tile_x] != 0; }
+
+    // Return true if any tile overlapping the given rectangle of pixels is occupied.
+    bool IsAreaOccupied(int x1, int y1, int x2, int y2) const;
+
+    // Return true if any tile is occupied.
+    bool IsAnyOccupied() const;
+
+    // Return the number of bytes allocated for the map.
+    size_t GetMemoryUsage() const;
+
+    // Return the ranges of pixels [start, end) on row y that are in occupied tiles,
+    // from left to right.
+    const vector<pair<int,int>> &GetOccupiedSpans(int y) const { return spans[y / TileSize]; }
+
+    int tiles_x = 0, tiles_y = 0;
+
+private:
+    int width = 0, height = 0;
+    vector<uint8_t> occupied;
+
+    // The occupied spans for each row of tiles.
+    vector<vector<pair<int,int>>> spans;
+};
+
+#endif
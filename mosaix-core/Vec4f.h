@@ -1,7 +1,8 @@
 #ifndef Vec4f_h
 #define Vec4f_h
 
-struct Vec4f
+// Vec4f is aligned to 16 bytes, so arrays of them can be loaded with SIMD instructions.
+struct alignas(16) Vec4f
 {
     float x, y, z, w; 
 
@@ -0,0 +1,578 @@
+#include "Vec4fKernels.h"
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+using namespace std;
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// Every kernel has to round exactly the same way.  GCC and clang fuse multiplies and
+// adds into FMA instructions when a function is compiled for an instruction set that has
+// them, which would make the AVX-512 kernels round differently from the others, so turn
+// that off here.  The projects build this file with /fp:precise, which doesn't contract.
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// GCC and clang only allow intrinsics for instruction sets the function is compiled for.
+// MSVC allows them anywhere.
+#if defined(HAVE_X86_KERNELS) && !defined(_MSC_VER)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+using namespace Vec4fKernels;
+
+namespace
+{
+    struct Kernels
+    {
+        void (*sum_lanes)(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes);
+        void (*write)(Vec4f *pixels, int count, const Vec4f &color);
+        void (*normalize)(Vec4f *colors, int count);
+        void (*alpha_composite)(Vec4f *bottom, const Vec4f *top, int count);
+        int (*find_first_above)(const Vec4f *pixels, int count, const Vec4f &threshold);
+        int (*find_last_above)(const Vec4f *pixels, int count, const Vec4f &threshold);
+    };
+
+    inline void NormalizeColor(Vec4f &color)
+    {
+        // color.w <= 0.01f is the same test as comparing against 0.01 as a double, since
+        // 0.01f is slightly less than 0.01.
+        if(color.w <= 0.01f)
+            color = Vec4f(0,0,0,0);
+        else
+            color *= 1.0f/color.w;
+    }
+
+    inline void WritePixel(Vec4f &output, const Vec4f &color)
+    {
+        output.x = color.x * output.w;
+        output.y = color.y * output.w;
+        output.z = color.z * output.w;
+    }
+
+    // Add pixels to lanes one at a time until the next pixel goes in lane 0, and return
+    // the number of pixels added.
+    inline int SumToFirstLane(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+    {
+        int i = 0;
+        for(; i < count && ((first_lane + i) & 3) != 0; ++i)
+            lanes[(first_lane + i) & 3] += pixels[i];
+        return i;
+    }
+
+    inline void CompositePixel(Vec4f &bottom, const Vec4f &top)
+    {
+        bottom = bottom*(1-top.w) + top;
+    }
+
+    inline bool IsAbove(const Vec4f &pixel, const Vec4f &threshold)
+    {
+        return
+            !(fabsf(pixel.x) <= threshold.x) || !(fabsf(pixel.y) <= threshold.y) ||
+            !(fabsf(pixel.z) <= threshold.z) || !(fabsf(pixel.w) <= threshold.w);
+    }
+
+    namespace Scalar
+    {
+        void SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+        {
+            for(int i = 0; i < count; ++i)
+                lanes[(first_lane + i) & 3] += pixels[i];
+        }
+
+        void Write(Vec4f *pixels, int count, const Vec4f &color)
+        {
+            for(int i = 0; i < count; ++i)
+                WritePixel(pixels[i], color);
+        }
+
+        void Normalize(Vec4f *colors, int count)
+        {
+            for(int i = 0; i < count; ++i)
+                NormalizeColor(colors[i]);
+        }
+
+        void AlphaComposite(Vec4f *bottom, const Vec4f *top, int count)
+        {
+            for(int i = 0; i < count; ++i)
+                CompositePixel(bottom[i], top[i]);
+        }
+
+        int FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            int i = 0;
+            while(i < count && !IsAbove(pixels[i], threshold))
+                ++i;
+            return i;
+        }
+
+        int FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            int i = count - 1;
+            while(i >= 0 && !IsAbove(pixels[i], threshold))
+                --i;
+            return i;
+        }
+
+        const Kernels kernels = { SumLanes, Write, Normalize, AlphaComposite, FindFirstAbove, FindLastAbove };
+    }
+
+#if defined(HAVE_X86_KERNELS)
+    // SSE2 handles one pixel per instruction.  It's always available on x64.
+    namespace SSE2
+    {
+        inline __m128 Load(const Vec4f *p) { return _mm_loadu_ps(&p->x); }
+        inline void Store(Vec4f *p, __m128 v) { _mm_storeu_ps(&p->x, v); }
+        inline __m128 BroadcastAlpha(__m128 v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,3,3,3)); }
+
+        void SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+        {
+            int i = SumToFirstLane(pixels, count, first_lane, lanes);
+            __m128 s0 = Load(lanes + 0), s1 = Load(lanes + 1), s2 = Load(lanes + 2), s3 = Load(lanes + 3);
+            for(; i + 4 <= count; i += 4)
+            {
+                s0 = _mm_add_ps(s0, Load(pixels + i + 0));
+                s1 = _mm_add_ps(s1, Load(pixels + i + 1));
+                s2 = _mm_add_ps(s2, Load(pixels + i + 2));
+                s3 = _mm_add_ps(s3, Load(pixels + i + 3));
+            }
+
+            if(i + 0 < count) s0 = _mm_add_ps(s0, Load(pixels + i + 0));
+            if(i + 1 < count) s1 = _mm_add_ps(s1, Load(pixels + i + 1));
+            if(i + 2 < count) s2 = _mm_add_ps(s2, Load(pixels + i + 2));
+
+            Store(lanes + 0, s0);
+            Store(lanes + 1, s1);
+            Store(lanes + 2, s2);
+            Store(lanes + 3, s3);
+        }
+
+        void Write(Vec4f *pixels, int count, const Vec4f &color)
+        {
+            const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+            __m128 c = Load(&color);
+            for(int i = 0; i < count; ++i)
+            {
+                __m128 p = Load(pixels + i);
+                __m128 rgb = _mm_mul_ps(c, BroadcastAlpha(p));
+                Store(pixels + i, _mm_or_ps(_mm_and_ps(rgb_mask, rgb), _mm_andnot_ps(rgb_mask, p)));
+            }
+        }
+
+        void Normalize(Vec4f *colors, int count)
+        {
+            const __m128 one = _mm_set1_ps(1.0f);
+            const __m128 threshold = _mm_set1_ps(0.01f);
+            for(int i = 0; i < count; ++i)
+            {
+                __m128 p = Load(colors + i);
+                __m128 alpha = BroadcastAlpha(p);
+                __m128 result = _mm_mul_ps(p, _mm_div_ps(one, alpha));
+                __m128 transparent = _mm_cmple_ps(alpha, threshold);
+                Store(colors + i, _mm_andnot_ps(transparent, result));
+            }
+        }
+
+        void AlphaComposite(Vec4f *bottom, const Vec4f *top, int count)
+        {
+            const __m128 one = _mm_set1_ps(1.0f);
+            for(int i = 0; i < count; ++i)
+            {
+                __m128 t = Load(top + i);
+                __m128 b = Load(bottom + i);
+                b = _mm_mul_ps(b, _mm_sub_ps(one, BroadcastAlpha(t)));
+                Store(bottom + i, _mm_add_ps(b, t));
+            }
+        }
+
+        // Return a nonzero mask if any channel of p is above threshold.
+        inline int AboveMask(__m128 p, __m128 threshold)
+        {
+            const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+            return _mm_movemask_ps(_mm_cmpnle_ps(_mm_and_ps(p, abs_mask), threshold));
+        }
+
+        int FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m128 t = Load(&threshold);
+            int i = 0;
+            while(i < count && !AboveMask(Load(pixels + i), t))
+                ++i;
+            return i;
+        }
+
+        int FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m128 t = Load(&threshold);
+            int i = count - 1;
+            while(i >= 0 && !AboveMask(Load(pixels + i), t))
+                --i;
+            return i;
+        }
+
+        const Kernels kernels = { SumLanes, Write, Normalize, AlphaComposite, FindFirstAbove, FindLastAbove };
+    }
+
+    // AVX2 handles two pixels per instruction, and uses SSE2 for leftover pixels.
+    namespace AVX2
+    {
+        TARGET_AVX2 inline __m256 Load(const Vec4f *p) { return _mm256_loadu_ps(&p->x); }
+        TARGET_AVX2 inline void Store(Vec4f *p, __m256 v) { _mm256_storeu_ps(&p->x, v); }
+        TARGET_AVX2 inline __m256 BroadcastAlpha(__m256 v) { return _mm256_permute_ps(v, _MM_SHUFFLE(3,3,3,3)); }
+
+        TARGET_AVX2 void SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+        {
+            // s01 holds lanes 0 and 1, and s23 holds 2 and 3.
+            int i = SumToFirstLane(pixels, count, first_lane, lanes);
+            __m256 s01 = Load(lanes + 0), s23 = Load(lanes + 2);
+            for(; i + 4 <= count; i += 4)
+            {
+                s01 = _mm256_add_ps(s01, Load(pixels + i + 0));
+                s23 = _mm256_add_ps(s23, Load(pixels + i + 2));
+            }
+
+            // Add leftover pixels to their lanes.  Adding zero to the other lane doesn't
+            // change it.
+            int left = count - i;
+            if(left >= 2)
+            {
+                s01 = _mm256_add_ps(s01, Load(pixels + i));
+                i += 2;
+            }
+            if(left & 1)
+            {
+                __m256 p = _mm256_insertf128_ps(_mm256_setzero_ps(), SSE2::Load(pixels + i), 0);
+                if(left == 1)
+                    s01 = _mm256_add_ps(s01, p);
+                else
+                    s23 = _mm256_add_ps(s23, p);
+            }
+
+            Store(lanes + 0, s01);
+            Store(lanes + 2, s23);
+        }
+
+        TARGET_AVX2 void Write(Vec4f *pixels, int count, const Vec4f &color)
+        {
+            __m256 c = _mm256_broadcast_ps((const __m128 *) &color.x);
+            int i = 0;
+            for(; i + 2 <= count; i += 2)
+            {
+                __m256 p = Load(pixels + i);
+                __m256 rgb = _mm256_mul_ps(c, BroadcastAlpha(p));
+                Store(pixels + i, _mm256_blend_ps(rgb, p, 0x88));
+            }
+            SSE2::Write(pixels + i, count - i, color);
+        }
+
+        TARGET_AVX2 void Normalize(Vec4f *colors, int count)
+        {
+            const __m256 one = _mm256_set1_ps(1.0f);
+            const __m256 threshold = _mm256_set1_ps(0.01f);
+            int i = 0;
+            for(; i + 2 <= count; i += 2)
+            {
+                __m256 p = Load(colors + i);
+                __m256 alpha = BroadcastAlpha(p);
+                __m256 result = _mm256_mul_ps(p, _mm256_div_ps(one, alpha));
+                __m256 transparent = _mm256_cmp_ps(alpha, threshold, _CMP_LE_OQ);
+                Store(colors + i, _mm256_andnot_ps(transparent, result));
+            }
+            SSE2::Normalize(colors + i, count - i);
+        }
+
+        TARGET_AVX2 void AlphaComposite(Vec4f *bottom, const Vec4f *top, int count)
+        {
+            const __m256 one = _mm256_set1_ps(1.0f);
+            int i = 0;
+            for(; i + 2 <= count; i += 2)
+            {
+                __m256 t = Load(top + i);
+                __m256 b = Load(bottom + i);
+                b = _mm256_mul_ps(b, _mm256_sub_ps(one, BroadcastAlpha(t)));
+                Store(bottom + i, _mm256_add_ps(b, t));
+            }
+            SSE2::AlphaComposite(bottom + i, top + i, count - i);
+        }
+
+        // Return a nonzero mask if any channel of the four pixels at p is above threshold.
+        TARGET_AVX2 inline int AboveMask4(const Vec4f *p, __m256 threshold)
+        {
+            const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+            __m256 above01 = _mm256_cmp_ps(_mm256_and_ps(Load(p + 0), abs_mask), threshold, _CMP_NLE_UQ);
+            __m256 above23 = _mm256_cmp_ps(_mm256_and_ps(Load(p + 2), abs_mask), threshold, _CMP_NLE_UQ);
+            return _mm256_movemask_ps(_mm256_or_ps(above01, above23));
+        }
+
+        // Skip groups of four pixels with nothing above threshold, then let SSE2 find the
+        // exact pixel.
+        TARGET_AVX2 int FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m256 t = _mm256_broadcast_ps((const __m128 *) &threshold.x);
+            int i = 0;
+            while(i + 4 <= count && !AboveMask4(pixels + i, t))
+                i += 4;
+            return i + SSE2::FindFirstAbove(pixels + i, count - i, threshold);
+        }
+
+        TARGET_AVX2 int FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m256 t = _mm256_broadcast_ps((const __m128 *) &threshold.x);
+            int end = count;
+            while(end >= 4 && !AboveMask4(pixels + end - 4, t))
+                end -= 4;
+            return SSE2::FindLastAbove(pixels, end, threshold);
+        }
+
+        const Kernels kernels = { SumLanes, Write, Normalize, AlphaComposite, FindFirstAbove, FindLastAbove };
+    }
+
+    // AVX-512 handles four pixels per instruction, using masks for leftover pixels.
+    namespace AVX512
+    {
+        // Return a mask for the first count pixels of a register.
+        inline __mmask16 PixelMask(int count) { return __mmask16((1 << (count*4)) - 1); }
+
+        TARGET_AVX512 inline __m512 Load(const Vec4f *p, int count) { return _mm512_maskz_loadu_ps(PixelMask(count), &p->x); }
+        TARGET_AVX512 inline void Store(Vec4f *p, __m512 v, int count) { _mm512_mask_storeu_ps(&p->x, PixelMask(count), v); }
+        TARGET_AVX512 inline __m512 BroadcastAlpha(__m512 v) { return _mm512_permute_ps(v, _MM_SHUFFLE(3,3,3,3)); }
+
+        TARGET_AVX512 void SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+        {
+            // Each 128-bit lane of the register holds one of the four lanes.  Masked loads
+            // fill pixels past the end with zero, which doesn't change the lanes.
+            int i = SumToFirstLane(pixels, count, first_lane, lanes);
+            __m512 s = Load(lanes, 4);
+            for(; i < count; i += 4)
+                s = _mm512_add_ps(s, Load(pixels + i, min(count - i, 4)));
+            Store(lanes, s, 4);
+        }
+
+        TARGET_AVX512 void Write(Vec4f *pixels, int count, const Vec4f &color)
+        {
+            __m512 c = _mm512_broadcast_f32x4(SSE2::Load(&color));
+            for(int i = 0; i < count; i += 4)
+            {
+                int n = min(count - i, 4);
+                __m512 p = Load(pixels + i, n);
+                __m512 rgb = _mm512_mul_ps(c, BroadcastAlpha(p));
+                Store(pixels + i, _mm512_mask_blend_ps(0x8888, rgb, p), n);
+            }
+        }
+
+        TARGET_AVX512 void Normalize(Vec4f *colors, int count)
+        {
+            const __m512 one = _mm512_set1_ps(1.0f);
+            const __m512 threshold = _mm512_set1_ps(0.01f);
+            for(int i = 0; i < count; i += 4)
+            {
+                int n = min(count - i, 4);
+                __m512 p = Load(colors + i, n);
+                __m512 alpha = BroadcastAlpha(p);
+                __m512 result = _mm512_mul_ps(p, _mm512_div_ps(one, alpha));
+                __mmask16 opaque = _mm512_cmp_ps_mask(alpha, threshold, _CMP_NLE_UQ);
+                Store(colors + i, _mm512_maskz_mov_ps(opaque, result), n);
+            }
+        }
+
+        TARGET_AVX512 void AlphaComposite(Vec4f *bottom, const Vec4f *top, int count)
+        {
+            const __m512 one = _mm512_set1_ps(1.0f);
+            for(int i = 0; i < count; i += 4)
+            {
+                int n = min(count - i, 4);
+                __m512 t = Load(top + i, n);
+                __m512 b = Load(bottom + i, n);
+                b = _mm512_mul_ps(b, _mm512_sub_ps(one, BroadcastAlpha(t)));
+                Store(bottom + i, _mm512_add_ps(b, t), n);
+            }
+        }
+
+        // Return a mask of the channels of the n pixels at p that are above threshold.
+        TARGET_AVX512 inline unsigned AboveMask(const Vec4f *p, int n, __m512 threshold)
+        {
+            __m512 magnitude = _mm512_abs_ps(Load(p, n));
+            return _mm512_mask_cmp_ps_mask(PixelMask(n), magnitude, threshold, _CMP_NLE_UQ);
+        }
+
+        TARGET_AVX512 int FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m512 t = _mm512_broadcast_f32x4(SSE2::Load(&threshold));
+            for(int i = 0; i < count; i += 4)
+            {
+                unsigned mask = AboveMask(pixels + i, min(count - i, 4), t);
+                for(int j = 0; mask != 0; ++j, mask >>= 4)
+                {
+                    if(mask & 0xF)
+                        return i + j;
+                }
+            }
+            return count;
+        }
+
+        TARGET_AVX512 int FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+        {
+            __m512 t = _mm512_broadcast_f32x4(SSE2::Load(&threshold));
+            for(int end = count; end > 0; end -= 4)
+            {
+                int start = max(end - 4, 0);
+                unsigned mask = AboveMask(pixels + start, end - start, t);
+                for(int j = end - start - 1; j >= 0; --j)
+                {
+                    if(mask & (0xF << (j*4)))
+                        return start + j;
+                }
+            }
+            return -1;
+        }
+
+        const Kernels kernels = { SumLanes, Write, Normalize, AlphaComposite, FindFirstAbove, FindLastAbove };
+    }
+
+    void CPUID(int leaf, int subleaf, unsigned regs[4])
+    {
+#if defined(_MSC_VER)
+        __cpuidex((int *) regs, leaf, subleaf);
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    // Return the OS-enabled register state from XGETBV.
+    unsigned long long GetEnabledState()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        unsigned eax, edx;
+        __asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return (unsigned long long) edx << 32 | eax;
+#endif
+    }
+
+    InstructionSet DetectInstructionSet()
+    {
+        unsigned regs[4];
+        CPUID(0, 0, regs);
+        unsigned max_leaf = regs[0];
+
+        CPUID(1, 0, regs);
+        bool osxsave = (regs[2] & (1 << 27)) != 0;
+        bool avx = (regs[2] & (1 << 28)) != 0;
+        if(max_leaf < 7 || !osxsave || !avx)
+            return InstructionSet::SSE2;
+
+        // Check that the OS saves the YMM registers, and the ZMM and mask registers for
+        // AVX-512.
+        unsigned long long state = GetEnabledState();
+        if((state & 0x06) != 0x06)
+            return InstructionSet::SSE2;
+
+        CPUID(7, 0, regs);
+        bool avx2 = (regs[1] & (1 << 5)) != 0;
+        bool avx512f = (regs[1] & (1 << 16)) != 0;
+        if(avx512f && (state & 0xE6) == 0xE6)
+            return InstructionSet::AVX512;
+        if(avx2)
+            return InstructionSet::AVX2;
+        return InstructionSet::SSE2;
+    }
+#else
+    InstructionSet DetectInstructionSet()
+    {
+        return InstructionSet::Scalar;
+    }
+#endif
+
+    const Kernels &GetKernelsFor(InstructionSet instruction_set)
+    {
+        switch(instruction_set)
+        {
+#if defined(HAVE_X86_KERNELS)
+        case InstructionSet::AVX512: return AVX512::kernels;
+        case InstructionSet::AVX2: return AVX2::kernels;
+        case InstructionSet::SSE2: return SSE2::kernels;
+#endif
+        default: return Scalar::kernels;
+        }
+    }
+
+    InstructionSet GetSupportedInstructionSet()
+    {
+        static const InstructionSet supported = DetectInstructionSet();
+        return supported;
+    }
+
+    atomic<const Kernels *> current_kernels(nullptr);
+    atomic<InstructionSet> current_instruction_set(InstructionSet::Scalar);
+
+    const Kernels &GetKernels()
+    {
+        const Kernels *kernels = current_kernels.load(memory_order_acquire);
+        if(kernels != nullptr)
+            return *kernels;
+
+        SetInstructionSet(GetSupportedInstructionSet());
+        return *current_kernels.load(memory_order_acquire);
+    }
+}
+
+InstructionSet Vec4fKernels::GetInstructionSet()
+{
+    GetKernels();
+    return current_instruction_set;
+}
+
+void Vec4fKernels::SetInstructionSet(InstructionSet instruction_set)
+{
+    if(int(instruction_set) > int(GetSupportedInstructionSet()))
+        instruction_set = GetSupportedInstructionSet();
+
+    current_instruction_set = instruction_set;
+    current_kernels.store(&GetKernelsFor(instruction_set), memory_order_release);
+}
+
+void Vec4fKernels::SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+{
+    GetKernels().sum_lanes(pixels, count, first_lane, lanes);
+}
+
+void Vec4fKernels::Write(Vec4f *pixels, int count, const Vec4f &color)
+{
+    GetKernels().write(pixels, count, color);
+}
+
+void Vec4fKernels::Normalize(Vec4f *colors, int count)
+{
+    GetKernels().normalize(colors, count);
+}
+
+void Vec4fKernels::AlphaComposite(Vec4f *bottom, const Vec4f *top, int count)
+{
+    GetKernels().alpha_composite(bottom, top, count);
+}
+
+int Vec4fKernels::FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+{
+    return GetKernels().find_first_above(pixels, count, threshold);
+}
+
+int Vec4fKernels::FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold)
+{
+    return GetKernels().find_last_above(pixels, count, threshold);
+}
@@ -0,0 +1,96 @@
+#ifndef Vec4fKernels_h
+#define Vec4fKernels_h
+
+#include "Vec4f.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+// Vectorized loops over arrays of Vec4f.  The implementation is chosen at runtime for
+// the CPU, and every implementation gives exactly the same result, so output doesn't
+// depend on the machine it was rendered on.
+namespace Vec4fKernels
+{
+    enum class InstructionSet
+    {
+        Scalar,
+        SSE2,
+        AVX2,
+        AVX512,
+    };
+
+    // Return the instruction set kernels are using.  This is the best one the CPU
+    // supports, unless SetInstructionSet has been called.
+    InstructionSet GetInstructionSet();
+
+    // Use the given instruction set, or the best one the CPU supports if it doesn't
+    // support that one.  This is for testing and benchmarking.
+    void SetInstructionSet(InstructionSet instruction_set);
+
+    // Add count pixels to four lanes of partial sums, adding pixel i to lane
+    // (first_lane + i) % 4.  This keeps four additions in flight, and the order is the
+    // same for every instruction set.  Passing the pixel's X coordinate as first_lane
+    // puts each pixel in the same lane no matter how a row is split into runs.
+    void SumLanes(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes);
+
+    // Set the color of count premultiplied pixels to color, leaving their alpha alone.
+    void Write(Vec4f *pixels, int count, const Vec4f &color);
+
+    // Set colors with alpha at or below 0.01 to zero, and divide the others by alpha,
+    // making them opaque.
+    void Normalize(Vec4f *colors, int count);
+
+    // Composite count premultiplied pixels from top over bottom.
+    void AlphaComposite(Vec4f *bottom, const Vec4f *top, int count);
+
+    // Return the index of the first pixel with any channel whose magnitude is above the
+    // same channel of threshold, or count if there isn't one.  NaN is above any threshold.
+    int FindFirstAbove(const Vec4f *pixels, int count, const Vec4f &threshold);
+
+    // The same, returning the index of the last pixel, or -1 if there isn't one.
+    int FindLastAbove(const Vec4f *pixels, int count, const Vec4f &threshold);
+
+    // SumLanes and Write are often called on runs of only a few pixels, where calling
+    // through to the dispatched kernel costs more than it saves.  These are the same as
+    // SumLanes and Write, but handle short runs inline.
+    const int ShortRunLength = 32;
+
+    inline void SumLanesRun(const Vec4f *pixels, int count, int first_lane, Vec4f *lanes)
+    {
+        if(count >= ShortRunLength)
+        {
+            SumLanes(pixels, count, first_lane, lanes);
+            return;
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            Vec4f &lane = lanes[(first_lane + i) & 3];
+#if defined(_M_X64) || defined(__x86_64__)
+            _mm_store_ps(&lane.x, _mm_add_ps(_mm_load_ps(&lane.x), _mm_load_ps(&pixels[i].x)));
+#else
+            lane += pixels[i];
+#endif
+        }
+    }
+
+    inline void WriteRun(Vec4f *pixels, int count, const Vec4f &color)
+    {
+        if(count >= ShortRunLength)
+        {
+            Write(pixels, count, color);
+            return;
+        }
+
+        for(int i = 0; i < count; ++i)
+        {
+            Vec4f &output = pixels[i];
+            output.x = color.x * output.w;
+            output.y = color.y * output.w;
+            output.z = color.z * output.w;
+        }
+    }
+}
+
+#endif
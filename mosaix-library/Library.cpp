@@ -0,0 +1,242 @@
+#include "mosaix.h"
+#include "../mosaix-core/Image.h"
+#include "../mosaix-core/Mosaic.h"
+#include "../mosaix-core/ThreadPool.h"
+#include <math.h>
+#include <new>
+#include <stdint.h>
+#include <string.h>
+
+namespace
+{
+    // Return the size of a pixel, or 0 if the pixel type isn't known.
+    size_t GetPixelSize(mosaix_pixel_type pixel_type)
+    {
+        switch(pixel_type)
+        {
+        case MOSAIX_PIXEL_FLOAT32: return sizeof(Vec4f);
+        case MOSAIX_PIXEL_FLOAT16: return sizeof(RgbaHalf);
+        case MOSAIX_PIXEL_UINT16: return sizeof(Rgba16);
+        case MOSAIX_PIXEL_UINT8: return sizeof(Rgba8);
+        default: return 0;
+        }
+    }
+
+    bool IsValid(const mosaix_image *image)
+    {
+        if(image == nullptr || image->pixels == nullptr || image->width < 0 || image->height < 0)
+            return false;
+
+        // Rows can't overlap each other.
+        ptrdiff_t row_size = ptrdiff_t(image->width) * GetPixelSize(image->pixel_type);
+        return image->height <= 1 || image->row_bytes >= row_size || -image->row_bytes >= row_size;
+    }
+
+    // NaN and infinity can't be mapped to a grid, so they're rejected here rather than
+    // reaching the grid math.
+    bool IsValid(const mosaix_options *options)
+    {
+        return options != nullptr && isfinite(options->block_size) && options->block_size > 0 &&
+            isfinite(options->angle);
+    }
+
+    bool IsSupported(const mosaix_image *image)
+    {
+        // The mosaic only treats the last channel specially, so any channel order with
+        // alpha last works unchanged.
+        return GetPixelSize(image->pixel_type) != 0 &&
+            (image->channel_order == MOSAIX_CHANNELS_RGBA || image->channel_order == MOSAIX_CHANNELS_BGRA);
+    }
+
+    // Compact pixels are always used in place.  Their channels need to be aligned, and rows
+    // need to be a whole number of pixels apart.
+    bool IsAligned(const mosaix_image *image)
+    {
+        size_t pixel_size = GetPixelSize(image->pixel_type);
+        size_t channel_size = pixel_size / 4;
+        return uintptr_t(image->pixels) % channel_size == 0 && image->row_bytes % ptrdiff_t(pixel_size) == 0;
+    }
+
+    template<typename Pixel>
+    BasicImageView<Pixel> GetPixelView(const mosaix_image *image)
+    {
+        return BasicImageView<Pixel>((Pixel *) image->pixels, image->width, image->height, image->row_bytes / ptrdiff_t(sizeof(Pixel)));
+    }
+
+    // Apply the mosaic in place to an image of compact pixels.
+    void ApplyToPixels(const mosaix_image *image, const Mosaic::Options &options)
+    {
+        switch(image->pixel_type)
+        {
+        case MOSAIX_PIXEL_FLOAT16: Mosaic::ApplyMosaic(GetPixelView<RgbaHalf>(image), options); break;
+        case MOSAIX_PIXEL_UINT16: Mosaic::ApplyMosaic(GetPixelView<Rgba16>(image), options); break;
+        case MOSAIX_PIXEL_UINT8: Mosaic::ApplyMosaic(GetPixelView<Rgba8>(image), options); break;
+        default: break;
+        }
+    }
+
+    // Views point directly at the caller's pixels, so they need to be aligned like Vec4f.
+    bool CanView(const mosaix_image *image)
+    {
+        return uintptr_t(image->pixels) % alignof(Vec4f) == 0 && image->row_bytes % ptrdiff_t(sizeof(Vec4f)) == 0;
+    }
+
+    ImageView GetView(const mosaix_image *image)
+    {
+        return ImageView((Vec4f *) image->pixels, image->width, image->height, image->row_bytes / ptrdiff_t(sizeof(Vec4f)));
+    }
+
+    const char *GetRow(const mosaix_image *image, int y)
+    {
+        return (const char *) image->pixels + y*image->row_bytes;
+    }
+
+    // Copy rows on the thread pool, so on NUMA systems the copy's rows are first touched
+    // on the nodes that will work on them.
+    void CopyToImage(const mosaix_image *image, Image &output, int threads)
+    {
+        output.width = image->width;
+        output.height = image->height;
+        ResizeUninitialized(output.rgba, size_t(image->width) * image->height);
+        ThreadPool::Get().ParallelFor(image->height, threads, [&](int y) {
+            memcpy(&output.ptr(0, y), GetRow(image, y), image->width * sizeof(Vec4f));
+        });
+    }
+
+    void CopyFromImage(const Image &image, const mosaix_image *output, int threads)
+    {
+        ThreadPool::Get().ParallelFor(image.height, threads, [&](int y) {
+            memcpy((char *) GetRow(output, y), &image.ptr(0, y), image.width * sizeof(Vec4f));
+        });
+    }
+
+    Mosaic::Options GetOptions(const mosaix_options &options)
+    {
+        Mosaic::Options result;
+        result.block_size = options.block_size;
+        result.angle = options.angle;
+        result.origin_x = options.origin_x;
+        result.origin_y = options.origin_y;
+        result.threads = options.threads;
+        return result;
+    }
+
+    // Don't let exceptions propagate back to C callers.
+    template<typename Func>
+    mosaix_result CatchExceptions(Func f)
+    {
+        try {
+            f();
+            return MOSAIX_OK;
+        } catch(const std::bad_alloc &) {
+            return MOSAIX_ERROR_OUT_OF_MEMORY;
+        } catch(...) {
+            return MOSAIX_ERROR_INTERNAL;
+        }
+    }
+}
+
+void mosaix_default_options(mosaix_options *options)
+{
+    Mosaic::Options defaults;
+    options->block_size = defaults.block_size;
+    options->angle = defaults.angle;
+    options->origin_x = defaults.origin_x;
+    options->origin_y = defaults.origin_y;
+    options->threads = defaults.threads;
+}
+
+mosaix_result mosaix_apply(const mosaix_image *image, const mosaix_options *options)
+{
+    if(!IsValid(image) || !IsValid(options))
+        return MOSAIX_ERROR_INVALID_ARGUMENT;
+    if(!IsSupported(image))
+        return MOSAIX_ERROR_UNSUPPORTED_FORMAT;
+
+    if(image->pixel_type != MOSAIX_PIXEL_FLOAT32)
+    {
+        if(!IsAligned(image))
+            return MOSAIX_ERROR_INVALID_ARGUMENT;
+        return CatchExceptions([&] { ApplyToPixels(image, GetOptions(*options)); });
+    }
+
+    return CatchExceptions([&] {
+        if(CanView(image))
+        {
+            Mosaic::ApplyMosaic(GetView(image), GetOptions(*options));
+            return;
+        }
+
+        Image copy;
+        CopyToImage(image, copy, options->threads);
+        Mosaic::ApplyMosaic(copy, GetOptions(*options));
+        CopyFromImage(copy, image, options->threads);
+    });
+}
+
+mosaix_result mosaix_apply_to(const mosaix_image *input, const mosaix_options *options, const mosaix_image *output)
+{
+    if(!IsValid(input) || !IsValid(output) || !IsValid(options))
+        return MOSAIX_ERROR_INVALID_ARGUMENT;
+    if(input->width != output->width || input->height != output->height)
+        return MOSAIX_ERROR_INVALID_ARGUMENT;
+    if(!IsSupported(input) || !IsSupported(output))
+        return MOSAIX_ERROR_UNSUPPORTED_FORMAT;
+
+    // We don't reorder channels.
+    if(input->pixel_type != output->pixel_type || input->channel_order != output->channel_order)
+        return MOSAIX_ERROR_UNSUPPORTED_FORMAT;
+
+    // Rendering in place only works if every row is in the same place.
+    if(input->pixels == output->pixels && input->row_bytes != output->row_bytes && input->height > 1)
+        return MOSAIX_ERROR_INVALID_ARGUMENT;
+
+    // Compact pixels are copied to the output and rendered there in place.
+    if(input->pixel_type != MOSAIX_PIXEL_FLOAT32)
+    {
+        if(!IsAligned(input) || !IsAligned(output))
+            return MOSAIX_ERROR_INVALID_ARGUMENT;
+
+        return CatchExceptions([&] {
+            size_t row_size = input->width * GetPixelSize(input->pixel_type);
+            if(input->pixels != output->pixels)
+            {
+                ThreadPool::Get().ParallelFor(input->height, options->threads, [&](int y) {
+                    memcpy((char *) GetRow(output, y), GetRow(input, y), row_size);
+                });
+            }
+            ApplyToPixels(output, GetOptions(*options));
+        });
+    }
+
+    return CatchExceptions([&] {
+        if(CanView(input) && CanView(output))
+        {
+            Mosaic::ApplyMosaic(ConstImageView(GetView(input)), GetOptions(*options), GetView(output));
+            return;
+        }
+
+        Image copy;
+        CopyToImage(input, copy, options->threads);
+        Mosaic::ApplyMosaic(copy, GetOptions(*options));
+        CopyFromImage(copy, output, options->threads);
+    });
+}
+
+const char *mosaix_error_string(mosaix_result result)
+{
+    switch(result)
+    {
+    case MOSAIX_OK: return "No error";
+    case MOSAIX_ERROR_INVALID_ARGUMENT: return "Invalid argument";
+    case MOSAIX_ERROR_UNSUPPORTED_FORMAT: return "Unsupported pixel format";
+    case MOSAIX_ERROR_OUT_OF_MEMORY: return "Out of memory";
+    case MOSAIX_ERROR_INTERNAL: return "Internal error";
+    default: return "Unknown error";
+    }
+}
+
+void mosaix_shutdown()
+{
+    ThreadPool::Shutdown();
+}
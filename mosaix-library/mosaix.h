@@ -0,0 +1,106 @@
+#ifndef MOSAIX_C_H
+#define MOSAIX_C_H
+
+// A C interface to the mosaic, for applying it to images in memory owned by the caller.
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#if defined(LIBMOSAIX_EXPORTS)
+#define MOSAIX_API __declspec(dllexport)
+#else
+#define MOSAIX_API __declspec(dllimport)
+#endif
+#else
+#define MOSAIX_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum mosaix_result
+{
+    MOSAIX_OK = 0,
+    MOSAIX_ERROR_INVALID_ARGUMENT = 1,
+    MOSAIX_ERROR_UNSUPPORTED_FORMAT = 2,
+    MOSAIX_ERROR_OUT_OF_MEMORY = 3,
+    MOSAIX_ERROR_INTERNAL = 4,
+} mosaix_result;
+
+typedef enum mosaix_pixel_type
+{
+    // Four 32-bit floats per pixel, premultiplied by alpha.
+    MOSAIX_PIXEL_FLOAT32 = 0,
+
+    // Four 16-bit half floats per pixel, premultiplied by alpha.
+    MOSAIX_PIXEL_FLOAT16 = 1,
+
+    // Four 16-bit integers per pixel from 0 to 65535, not premultiplied.
+    MOSAIX_PIXEL_UINT16 = 2,
+
+    // Four 8-bit integers per pixel from 0 to 255, not premultiplied.
+    MOSAIX_PIXEL_UINT8 = 3,
+} mosaix_pixel_type;
+
+typedef enum mosaix_channel_order
+{
+    MOSAIX_CHANNELS_RGBA = 0,
+    MOSAIX_CHANNELS_BGRA = 1,
+} mosaix_channel_order;
+
+// An image in memory owned by the caller.  Row y starts at pixels + y*row_bytes.
+// row_bytes may be larger than a row, or negative for bottom-up images.
+//
+// If pixels and row_bytes are both multiples of 16, the mosaic is applied directly
+// to this memory.  Otherwise, the image is copied first.  Other pixel types are always
+// applied directly to this memory, and only need to be aligned to their channel size.
+typedef struct mosaix_image
+{
+    void *pixels;
+    int width;
+    int height;
+    ptrdiff_t row_bytes;
+    mosaix_pixel_type pixel_type;
+    mosaix_channel_order channel_order;
+} mosaix_image;
+
+typedef struct mosaix_options
+{
+    // The size of each block in pixels.  This must be finite and above 0.
+    float block_size;
+
+    // The rotation of the blocks in degrees.  This must be finite.
+    float angle;
+
+    int origin_x;
+    int origin_y;
+
+    // The number of threads to use.  If 0, use one per CPU core.
+    int threads;
+} mosaix_options;
+
+// Fill in options with the defaults.
+MOSAIX_API void mosaix_default_options(mosaix_options *options);
+
+// Apply the mosaic to image in place.  Options that are out of range, including NaN and
+// infinite block sizes and angles, return MOSAIX_ERROR_INVALID_ARGUMENT.
+MOSAIX_API mosaix_result mosaix_apply(const mosaix_image *image, const mosaix_options *options);
+
+// Render the mosaic of input into output, without changing input.  The images must be
+// the same size and format.  output may be the same memory as input, but may not
+// otherwise overlap it.  Options are checked like mosaix_apply.
+MOSAIX_API mosaix_result mosaix_apply_to(const mosaix_image *input, const mosaix_options *options, const mosaix_image *output);
+
+// Return a description of an error code.
+MOSAIX_API const char *mosaix_error_string(mosaix_result result);
+
+// Stop the threads used for rendering.  Call this before unloading the library.  They're
+// restarted automatically if anything is rendered afterwards.
+MOSAIX_API void mosaix_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 #include "UI.h"
 
 #include "../mosaix-core/Mosaic.h"
+#include "../mosaix-core/ThreadPool.h"
 
 #include <stdio.h>
 #include <string>
@@ -229,6 +230,58 @@ void CopyToPhotoshop(FilterRecord *pFilterRecord, shared_ptr<const Image> image)
     }
 }
 
+// 8-bit documents are copied to an Image8 as is, so they can be mosaiced in integers
+// without converting them to float and back.  Color is left straight, as Image8 expects.
+void CopyFromPhotoshop8(const FilterRecord *pFilterRecord, Image8 &out)
+{
+    int first_channel, color_channels, alpha_channel;
+    GetColorChannels(pFilterRecord, true, first_channel, color_channels, alpha_channel);
+
+    // This zeroes the pixels, so channels a gray document doesn't have are 0.
+    VPoint size = pFilterRecord->bigDocumentData->imageSize32;
+    out.Alloc(size.h, size.v);
+
+    const uint8_t *photoshop_image = (const uint8_t *) pFilterRecord->inData;
+    int planes = pFilterRecord->inHiPlane + 1;
+    for(int y = 0; y < out.height; ++y)
+    {
+        const uint8_t *row = &photoshop_image[y*pFilterRecord->inRowBytes];
+        for(int x = 0; x < out.width; ++x)
+        {
+            const uint8_t *d = &row[x*planes];
+            Rgba8 &color = out.ptr(x, y);
+            uint8_t *rgb[] = { &color.r, &color.g, &color.b };
+            for(int c = 0; c < color_channels; ++c)
+                *rgb[c] = d[first_channel + c];
+
+            // If we have no alpha channel, set it to opaque.
+            color.a = alpha_channel != -1? d[alpha_channel]:255;
+        }
+    }
+}
+
+void CopyToPhotoshop8(FilterRecord *pFilterRecord, const Image8 &image)
+{
+    int first_channel, color_channels, alpha_channel;
+    GetColorChannels(pFilterRecord, false, first_channel, color_channels, alpha_channel);
+
+    uint8_t *photoshop_image = (uint8_t *) pFilterRecord->outData;
+    int planes = pFilterRecord->outHiPlane + 1;
+    for(int y = 0; y < image.height; ++y)
+    {
+        uint8_t *row = &photoshop_image[y*pFilterRecord->outRowBytes];
+        for(int x = 0; x < image.width; ++x)
+        {
+            // We don't modify alpha, so we don't have to copy it out here.
+            uint8_t *d = &row[x*planes];
+            const Rgba8 &color = image.ptr(x, y);
+            const uint8_t rgb[] = { color.r, color.g, color.b };
+            for(int c = 0; c < color_channels; ++c)
+                d[first_channel + c] = rgb[c];
+        }
+    }
+}
+
 // Return the total number of input or output planes.
 int GetTotalPlanes(const FilterRecord *pFilterRecord, bool input)
 {
@@ -270,16 +323,18 @@ static void Run(FilterRecord *pFilterRecord)
     // Set up the input and output buffers.
     InitSourceImage(pFilterRecord);
 
-    // Copy the data from outData to our image.
-    shared_ptr<Image> image = make_shared<Image>();
-    CopyFromPhotoshop(pFilterRecord, image);
-
     Mosaic::Options options;
     ReadRegistryParameters(options);
     ReadScriptParameters(options);
 
+    // The preview works on a float copy of the image.  8-bit documents are only converted
+    // to float for the preview, and are rendered below without it.
+    shared_ptr<Image> image;
     if(pFilterRecord->descriptorParameters->playInfo == plugInDialogDisplay)
     {
+        image = make_shared<Image>();
+        CopyFromPhotoshop(pFilterRecord, image);
+
         bool ret = DoUI(options, image);
 
         if(!ret)
@@ -290,6 +345,25 @@ static void Run(FilterRecord *pFilterRecord)
 
     WriteScriptParameters(options);
 
+    // Mosaic 8-bit documents in 8 bits, which sums them in integers.
+    if(pFilterRecord->depth == 8)
+    {
+        image.reset();
+
+        Image8 image8;
+        CopyFromPhotoshop8(pFilterRecord, image8);
+        Mosaic::ApplyMosaic(image8.GetView(), options);
+        CopyToPhotoshop8(pFilterRecord, image8);
+        return;
+    }
+
+    // Copy the data from inData to our image, if the preview didn't already.
+    if(!image)
+    {
+        image = make_shared<Image>();
+        CopyFromPhotoshop(pFilterRecord, image);
+    }
+
     // Apply the mosaic.
     Mosaic::ApplyMosaic(*image.get(), options);
 
@@ -366,6 +440,12 @@ DLLExport MACPASCAL void PluginMain(const int16 iSelector, void *pFilterRecord_,
     else
     {
         *pResult = RunPlugin(pFilterRecord, iSelector);
+
+        // Photoshop may unload us once the filter is done, so stop the thread pool after the
+        // last selector of a run.  Finish isn't called if an earlier selector fails, so stop
+        // it on errors too.  It'll be restarted the next time it's needed.
+        if(iSelector == filterSelectorFinish || *pResult != noErr)
+            ThreadPool::Shutdown();
     }
 }
 
@@ -5,18 +5,41 @@
 using namespace std;
 
 #include "../mosaix-core/Mosaic.h"
+#include "../mosaix-core/ThreadPool.h"
 
 namespace
 {
-    void ConvertToBGRX(shared_ptr<const Image> image, vector<uint32_t> &output)
+    /* The samples across each block for interactive previews of rotated grids.  The
+     * samples and their error go down with the square of this. */
+    const int InteractiveSamplesPerBlock = 8;
+
+    /* The largest summed-area table to build, in pixels.  Tables take 32 bytes per pixel,
+     * so this is 256MB.  Renders that need more are done directly. */
+    const size_t MaxTablePixels = 8*1024*1024;
+
+    size_t GetArea(const Mosaic::Rect &rect)
     {
-        output.resize(image->width*image->height, 0);
-        uint32_t *data = output.data();
-        for(int y = 0; y < image->height; ++y)
-        {
-            for(int x = 0; x < image->width; ++x)
+        return rect.IsEmpty()? 0:size_t(rect.x2 - rect.x1) * size_t(rect.y2 - rect.y1);
+    }
+
+    Mosaic::Rect IntersectRect(const Mosaic::Rect &lhs, const Mosaic::Rect &rhs)
+    {
+        Mosaic::Rect result = {
+            max(lhs.x1, rhs.x1), max(lhs.y1, rhs.y1),
+            min(lhs.x2, rhs.x2), min(lhs.y2, rhs.y2),
+        };
+        return result.IsEmpty()? Mosaic::Rect():result;
+    }
+
+    void ConvertToBGRX(const Image &image, vector<uint32_t> &output)
+    {
+        output.resize(size_t(image.width) * image.height);
+        ThreadPool::Get().ParallelFor(image.height, 0, [&](int y) {
+            const Vec4f *row = &image.rgba[y*image.width];
+            uint32_t *data = &output[y*image.width];
+            for(int x = 0; x < image.width; ++x)
             {
-                Vec4f c = image->ptr(x, y);
+                const Vec4f &c = row[x];
 
                 // The input color is premultiplied.  Leave it that way, since we're not
                 // blending the preview and this fades alpha against black.
@@ -31,28 +54,87 @@ namespace
 
                 *(data++) = result;
             }
-        }
+        });
     }
 }
 
 void PreviewRenderer::SetSourceImage(shared_ptr<const Image> NewSourceImage)
 {
     SourceImage = NewSourceImage;
-    ConvertToBGRX(SourceImage, SourceImage8BPP);
+    ConvertToBGRX(*SourceImage, SourceImage8BPP);
+    SourceTable.Release();
 
     CurrentPreview = make_shared<Image>();
+    PreviewRect = Mosaic::Rect();
+    bApplied = false;
 }
 
-void PreviewRenderer::UpdatePreview()
+void PreviewRenderer::UpdatePreview(bool bInteractive)
 {
-    if(CurrentSettings == AppliedSettings)
+    Mosaic::Rect Rect = IntersectRect(VisibleRect, Mosaic::Rect { 0, 0, SourceImage->width, SourceImage->height });
+
+    // Re-render unchanged settings if the last render was interactive and this one isn't.
+    if(bApplied && CurrentSettings == AppliedSettings && Rect == PreviewRect && (bInteractive || !bAppliedInteractive))
         return;
     AppliedSettings = CurrentSettings;
+    PreviewRect = Rect;
+    bApplied = true;
+    bAppliedInteractive = bInteractive;
 
-    // Run the filter.
-	*CurrentPreview = *SourceImage;
-    Mosaic::ApplyMosaic(*CurrentPreview.get(), CurrentSettings);
+    // Run the filter on the visible part of the image.
+    Render(PreviewRect, bInteractive);
 
     // Convert to 8-bit RGBA for the preview.
-    ConvertToBGRX(CurrentPreview, CurrentPreview8BPP);
+    ConvertToBGRX(*CurrentPreview, CurrentPreview8BPP);
+}
+
+/* Render rect of the mosaic into CurrentPreview. */
+void PreviewRenderer::Render(const Mosaic::Rect &rect, bool bInteractive)
+{
+    const Image &image = *SourceImage;
+    if(rect.IsEmpty())
+    {
+        CurrentPreview->width = CurrentPreview->height = 0;
+        CurrentPreview->rgba.clear();
+        return;
+    }
+
+    if(Mosaic::IsAxisAligned(CurrentSettings))
+    {
+        // The summed-area table lets the block size and offset change without rescanning
+        // the image.  Build it the first time it's needed.  If the whole image is too big,
+        // build it around the blocks this render needs, with room to pan or grow the blocks
+        // by the size of the preview before it has to be rebuilt.
+        if(!SourceTable.CanRender(CurrentSettings, rect))
+        {
+            Mosaic::Rect ImageRect = { 0, 0, image.width, image.height };
+            Mosaic::Rect TableRect = ImageRect;
+            if(GetArea(TableRect) > MaxTablePixels)
+            {
+                Mosaic::Rect InputRect = Mosaic::GetInputRect(image.width, image.height, CurrentSettings, rect);
+                int iMarginX = rect.x2 - rect.x1, iMarginY = rect.y2 - rect.y1;
+                TableRect = IntersectRect(ImageRect, Mosaic::Rect {
+                    InputRect.x1 - iMarginX, InputRect.y1 - iMarginY,
+                    InputRect.x2 + iMarginX, InputRect.y2 + iMarginY });
+                if(GetArea(TableRect) > MaxTablePixels)
+                    TableRect = InputRect;
+            }
+
+            if(GetArea(TableRect) <= MaxTablePixels)
+                SourceTable.Build(SourceImage, TableRect);
+        }
+
+        if(SourceTable.CanRender(CurrentSettings, rect))
+        {
+            SourceTable.Render(CurrentSettings, rect, *CurrentPreview);
+            return;
+        }
+    }
+    else if(bInteractive)
+    {
+        Mosaic::ApplyMosaicApproximate(image, CurrentSettings, InteractiveSamplesPerBlock, rect, *CurrentPreview);
+        return;
+    }
+
+    PreviewEngine.ApplyMosaicToRect(image, 0, 0, CurrentSettings, rect, *CurrentPreview);
 }
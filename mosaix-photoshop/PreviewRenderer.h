@@ -11,21 +11,42 @@ struct PreviewRenderer
 {
     void SetSourceImage(shared_ptr<const Image> SourceImage);
 
-	void UpdatePreview();
+	/* Render the preview if the settings or VisibleRect have changed.  If bInteractive is
+	 * true, the settings are still changing, so render quickly, approximating rotated grids.
+	 * Call again with bInteractive false once they settle to render the exact preview. */
+	void UpdatePreview(bool bInteractive = false);
 
     /* Unprocessed image. */
     shared_ptr<const Image> SourceImage;
+
+    /* A summed-area table of the source for axis-aligned renders.  It's built by the first
+     * render that can use it, over the whole image if it's small enough, or else around the
+     * preview. */
+    Mosaic::SummedAreaTable SourceTable;
+
+    /* Keeps the bucket grid between renders the table can't do. */
+    Mosaic::Engine PreviewEngine;
     vector<uint32_t> SourceImage8BPP;
 
-    /* Processed preview image and original.  iX and iY will be <= iPreviewX, iPreviewY. */
+    /* Processed preview image, and the part of the image it covers: VisibleRect clipped
+     * to the image when it was rendered. */
     shared_ptr<Image> CurrentPreview;
     vector<uint32_t> CurrentPreview8BPP;
+    Mosaic::Rect PreviewRect;
 
 	/* The current settings in the UI.  These aren't necessarily applied. */
     Mosaic::Options CurrentSettings;
 
+    /* The part of the image the UI is showing, in image coordinates.  Only this part is
+     * rendered. */
+    Mosaic::Rect VisibleRect;
+
 private:
+	void Render(const Mosaic::Rect &rect, bool bInteractive);
+
 	/* The options which are actually applied, and the final results. */
 	Mosaic::Options AppliedSettings;
+	bool bApplied = false;
+	bool bAppliedInteractive = false;
 };
 #endif
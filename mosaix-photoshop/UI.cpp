@@ -21,9 +21,14 @@ struct UIData
     void PaintProxy(HWND hDlg);
     void UpdateDisplayAfterSettingsChange(HWND hDlg);
     void RedrawProxyItem(HWND hDlg);
-    void PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &image_data);
+    void PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &image_data, int iOriginX, int iOriginY);
     void SetPreviewPosition(HWND hDlg, int iX, int iY);
 
+    /* The timer that renders the exact preview once settings stop changing, and how long
+     * they have to stay the same. */
+    static const UINT_PTR SettleTimerID = 1;
+    static const UINT SettleTimeMs = 250;
+
     PreviewRenderer *m_pFilter;
     bool bDraggingPreview;
     bool bDraggingSnapped;
@@ -56,7 +61,7 @@ UIData::UIData()
     g_iFocusedEditControl = -1;
 }
 
-void UIData::PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &image_data)
+void UIData::PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &image_data, int iOriginX, int iOriginY)
 {
     RECT wRect;
     GetClientRect(hDlg, &wRect);
@@ -78,7 +83,8 @@ void UIData::PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &i
 
     /*
     * Render image.PreviewImage into hDC.  The draw area is wRect.  Zoom the display
-    * by GetPreviewZoom().  The top-left source pixel to draw is iImageX/iImageY.
+    * by GetPreviewZoom().  The top-left source pixel to draw is iImageX/iImageY.  image
+    * may be only part of the document, with its top-left corner at iOriginX/iOriginY.
     *
     * StretchDIBits makes this a pain.  We can handle the scaling by scaling the source
     * dimensions, but then we won't know the exact bounds of what's being rendered if
@@ -88,8 +94,8 @@ void UIData::PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &i
     * If the zoom won't fill the area, then handle the scaling by adjusting wRect.  Otherwise,
     * handle it by adjusting iSourceWidth.
     */
-    int iImageX = iPreviewX;
-    int iImageY = iPreviewY;
+    int iImageX = iPreviewX - iOriginX;
+    int iImageY = iPreviewY - iOriginY;
     int iDestX = wRect.left;
     int iDestY = wRect.top;
 
@@ -97,19 +103,19 @@ void UIData::PaintImage(HWND hDlg, const Image &image, const vector<uint32_t> &i
     int iDestHeight = wRect.bottom - wRect.top;
     int iSourceImageWidth = image.width - iImageX;
     int iSourceImageHeight = image.height - iImageY;
-    if(iPreviewX < 0)
+    if(iImageX < 0)
     {
-        iDestX += -iPreviewX;
+        iDestX += -iImageX;
+        iDestWidth -= -iImageX;
+        iSourceImageWidth -= -iImageX;
         iImageX = 0;
-        iDestWidth -= -iPreviewX;
-        iSourceImageWidth -= -iPreviewX;
     }
-    if(iPreviewY < 0)
+    if(iImageY < 0)
     {
-        iDestY += -iPreviewY;
+        iDestY += -iImageY;
+        iDestHeight -= -iImageY;
+        iSourceImageHeight -= -iImageY;
         iImageY = 0;
-        iDestHeight -= -iPreviewY;
-        iSourceImageHeight -= -iPreviewY;
     }
 
     int iSourceWidth;
@@ -180,10 +186,14 @@ void UIData::PaintProxy(HWND hDlg)
     if(bDraggingPreview || m_pFilter->CurrentPreview->width == 0)
     {
         /* When we're dragging the image around, always draw the original image. */
-        PaintImage(hDlg, *m_pFilter->SourceImage.get(), m_pFilter->SourceImage8BPP);
+        PaintImage(hDlg, *m_pFilter->SourceImage.get(), m_pFilter->SourceImage8BPP, 0, 0);
     }
     else if(m_pFilter->CurrentPreview->width != 0)
-        PaintImage(hDlg, *m_pFilter->CurrentPreview.get(), m_pFilter->CurrentPreview8BPP);
+    {
+        /* The preview only covers the part of the image that was visible when it was rendered. */
+        const Mosaic::Rect &PreviewRect = m_pFilter->PreviewRect;
+        PaintImage(hDlg, *m_pFilter->CurrentPreview.get(), m_pFilter->CurrentPreview8BPP, PreviewRect.x1, PreviewRect.y1);
+    }
 }
 
 void UIData::RedrawProxyItem(HWND hDlg)
@@ -238,12 +248,21 @@ void UIData::SetPreviewPosition(HWND hDlg, int iX, int iY)
 {
     iPreviewX = iX;
     iPreviewY = iY;
+
+    /* Only the part of the image inside the proxy's frame is rendered. */
+    RECT wRect;
+    GetClientRect(GetDlgItem(hDlg, ID_PROXY_ITEM), &wRect);
+    InflateRect(&wRect, -1, -1);
+    m_pFilter->VisibleRect = Mosaic::Rect { iX, iY, iX + (wRect.right - wRect.left), iY + (wRect.bottom - wRect.top) };
 }
 
 void UIData::UpdateDisplayAfterSettingsChange(HWND hDlg)
 {
-    m_pFilter->UpdatePreview();
+    /* Render a quick preview while settings are changing, and restart the timer to render
+     * the exact one when they settle. */
+    m_pFilter->UpdatePreview(true);
     RedrawProxyItem(hDlg);
+    SetTimer(hDlg, SettleTimerID, SettleTimeMs, NULL);
 }
 
 namespace
@@ -394,8 +413,17 @@ namespace
         switch(wMsg)
         {
         case WM_DESTROY:
+            KillTimer(hDlg, UIData::SettleTimerID);
             DestroyCursor(pData->g_hCursorHand);
             return TRUE;
+        case WM_TIMER:
+            if(wParam != UIData::SettleTimerID)
+                return FALSE;
+
+            KillTimer(hDlg, UIData::SettleTimerID);
+            pData->m_pFilter->UpdatePreview(false);
+            pData->RedrawProxyItem(hDlg);
+            return TRUE;
         case WM_INITDIALOG:
             pData = (UIData *) lParam;
             SetWindowLongPtr(hDlg, GWLP_USERDATA, lParam);